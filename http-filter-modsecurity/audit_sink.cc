@@ -0,0 +1,573 @@
+#include "audit_sink.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <utility>
+#include <vector>
+
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_cat.h"
+#include "common/common/fmt.h"
+#include "envoy/common/exception.h"
+
+namespace Envoy {
+namespace Http {
+
+namespace {
+
+constexpr uint64_t DefaultMaxBodyBytes = 64 * 1024;
+constexpr uint64_t DefaultMaxHeadersBytes = 16 * 1024;
+constexpr uint64_t DefaultSpillBytes = 256 * 1024;
+constexpr uint64_t DefaultMaxPendingBytes = 64 * 1024 * 1024;
+// Spilled records waiting to be written, each holds a file descriptor
+constexpr uint32_t DefaultMaxPendingSpills = 64;
+
+const char Redacted[] = "[redacted]";
+
+/**
+ * Calls fn with the first limit bytes of buffered followed by current, slice by slice
+ */
+template <class Fn>
+void forEachSlice(const Buffer::Instance* buffered, const Buffer::Instance* current, uint64_t limit, Fn fn) {
+    for (const Buffer::Instance* buffer : {buffered, current}) {
+        if (buffer == nullptr) {
+            continue;
+        }
+        for (const Buffer::RawSlice& slice : buffer->getRawSlices()) {
+            if (limit == 0) {
+                return;
+            }
+            const uint64_t len = std::min<uint64_t>(slice.len_, limit);
+            fn(absl::string_view(static_cast<const char*>(slice.mem_), len));
+            limit -= len;
+        }
+    }
+}
+
+/**
+ * @return false on failure, errno is set
+ */
+bool writeAll(int fd, absl::string_view data) {
+    while (!data.empty()) {
+        const ssize_t rc = ::write(fd, data.data(), data.size());
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data.remove_prefix(rc);
+    }
+    return true;
+}
+
+/**
+ * Positions of the closing braces in ModSecurity's JSON record:
+ * {"transaction":{...,"request":{...},"response":{...},...}}
+ */
+struct JsonLayout {
+    size_t transaction_end = std::string::npos;
+    size_t request_end = std::string::npos;
+    size_t response_end = std::string::npos;
+};
+
+JsonLayout scanJson(absl::string_view json) {
+    JsonLayout layout;
+    // Keys of the objects and arrays currently open, outermost first
+    std::vector<absl::string_view> keys;
+    absl::string_view last_string;
+    absl::string_view key;
+    size_t string_start = 0;
+    bool in_string = false;
+    bool escaped = false;
+    for (size_t i = 0; i < json.size(); i++) {
+        const char c = json[i];
+        if (in_string) {
+            if (escaped) {
+                escaped = false;
+            } else if (c == '\\') {
+                escaped = true;
+            } else if (c == '"') {
+                in_string = false;
+                last_string = json.substr(string_start, i - string_start);
+            }
+            continue;
+        }
+        switch (c) {
+        case '"':
+            in_string = true;
+            string_start = i + 1;
+            break;
+        case ':':
+            key = last_string;
+            break;
+        case ',':
+            key = absl::string_view();
+            break;
+        case '{':
+        case '[':
+            keys.push_back(key);
+            key = absl::string_view();
+            break;
+        case '}':
+        case ']':
+            if (keys.empty()) {
+                return JsonLayout();
+            }
+            if (c == '}' && keys.size() >= 2 && keys[1] == "transaction") {
+                if (keys.size() == 2) {
+                    layout.transaction_end = i;
+                } else if (keys.size() == 3 && keys[2] == "request") {
+                    layout.request_end = i;
+                } else if (keys.size() == 3 && keys[2] == "response") {
+                    layout.response_end = i;
+                }
+            }
+            keys.pop_back();
+            break;
+        default:
+            break;
+        }
+    }
+    return layout;
+}
+
+/**
+ * @return true if the object closed at end has no members
+ */
+bool emptyObject(const std::string& json, size_t end) {
+    const size_t last = json.find_last_not_of(" \t\r\n", end - 1);
+    return last != std::string::npos && json[last] == '{';
+}
+
+} // namespace
+
+AuditSink::AuditSink(const envoy::config::filter::http::modsec::v2::AuditLog& proto_config, Api::Api& api,
+                     Stats::Scope& scope)
+    : max_request_body_bytes_(proto_config.max_request_body_bytes() > 0 ? proto_config.max_request_body_bytes()
+                                                                        : DefaultMaxBodyBytes),
+      max_response_body_bytes_(proto_config.max_response_body_bytes() > 0 ? proto_config.max_response_body_bytes()
+                                                                          : DefaultMaxBodyBytes),
+      max_headers_bytes_(proto_config.max_headers_bytes() > 0 ? proto_config.max_headers_bytes() : DefaultMaxHeadersBytes),
+      spill_bytes_(proto_config.spill_bytes() > 0 ? proto_config.spill_bytes() : DefaultSpillBytes),
+      spill_path_(proto_config.spill_path().empty() ? "/tmp" : proto_config.spill_path()),
+      max_pending_bytes_(proto_config.max_pending_bytes() > 0 ? proto_config.max_pending_bytes() : DefaultMaxPendingBytes),
+      max_pending_spills_(proto_config.max_pending_spills() > 0 ? proto_config.max_pending_spills()
+                                                                : DefaultMaxPendingSpills),
+      stats_{ALL_MODSEC_AUDIT_STATS(POOL_COUNTER_PREFIX(scope, "modsecurity."), POOL_GAUGE_PREFIX(scope, "modsecurity."))},
+      pending_bytes_(0), pending_spills_(0), output_fd_(-1) {
+
+    for (const auto& header : proto_config.redact_headers()) {
+        redact_headers_.insert(absl::AsciiStrToLower(header));
+    }
+    for (const auto& pattern : proto_config.redact_patterns()) {
+        auto regex = std::make_unique<re2::RE2>(pattern, re2::RE2::Quiet);
+        if (!regex->ok()) {
+            throw EnvoyException(fmt::format("Invalid ModSecurity audit log redact pattern '{}': {}", pattern, regex->error()));
+        }
+        redact_patterns_.emplace_back(std::move(regex));
+    }
+    if (!proto_config.path().empty()) {
+        output_fd_ = open(proto_config.path().c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if (output_fd_ < 0) {
+            throw EnvoyException(fmt::format("Failed to open ModSecurity audit log {}: {}", proto_config.path(), strerror(errno)));
+        }
+    }
+
+    // Pending records are still written on shutdown
+    BackgroundQueue<PendingAuditRecord>::Options writer_options;
+    writer_options.drain_on_shutdown = true;
+    writer_ = std::make_unique<BackgroundQueue<PendingAuditRecord>>(
+        api, [this](PendingAuditRecord& record) -> void { write(record); }, std::move(writer_options));
+    BackgroundQueue<PendingAuditRecord>::Options spiller_options;
+    spiller_options.drain_on_shutdown = true;
+    spiller_ = std::make_unique<BackgroundQueue<PendingAuditRecord>>(
+        api, [this](PendingAuditRecord& record) -> void { spill(record); }, std::move(spiller_options));
+}
+
+AuditSink::~AuditSink() {
+    // The spill thread hands its last records to the writer thread
+    spiller_->stop();
+    writer_->stop();
+    if (output_fd_ >= 0) {
+        close(output_fd_);
+    }
+}
+
+void AuditSink::submit(std::string&& data) {
+    const uint64_t bytes = data.size();
+    if (pending_bytes_.fetch_add(bytes) + bytes > max_pending_bytes_) {
+        pending_bytes_ -= bytes;
+        stats_.audit_dropped_.inc();
+        return;
+    }
+    stats_.audit_pending_bytes_.add(bytes);
+    PendingAuditRecord record{std::move(data), -1, bytes};
+    if (bytes <= spill_bytes_) {
+        enqueue(std::move(record));
+        return;
+    }
+    // Moved to a temp file while it waits for the writer, which gives its memory back
+    if (!spiller_->push(std::move(record))) {
+        release(record);
+        stats_.audit_dropped_.inc();
+    }
+}
+
+void AuditSink::enqueue(PendingAuditRecord&& record) {
+    if (writer_->push(std::move(record))) {
+        return;
+    }
+    release(record);
+    stats_.audit_dropped_.inc();
+    if (record.fd >= 0) {
+        close(record.fd);
+    }
+}
+
+void AuditSink::release(const PendingAuditRecord& record) {
+    if (record.fd < 0) {
+        pending_bytes_ -= record.size;
+        stats_.audit_pending_bytes_.sub(record.size);
+    } else {
+        pending_spills_--;
+    }
+}
+
+void AuditSink::spill(PendingAuditRecord& record) {
+    // Otherwise the record waits in memory
+    if (pending_spills_.fetch_add(1) >= max_pending_spills_) {
+        pending_spills_--;
+        enqueue(std::move(record));
+        return;
+    }
+    const int fd = createSpillFile();
+    if (fd < 0 || !writeAll(fd, record.data)) {
+        if (fd >= 0) {
+            ENVOY_LOG(error, "Failed to write ModSecurity audit log spill file: {}", strerror(errno));
+            close(fd);
+        }
+        pending_spills_--;
+        enqueue(std::move(record));
+        return;
+    }
+    release(record);
+    std::string().swap(record.data);
+    record.fd = fd;
+    stats_.audit_spilled_.inc();
+    enqueue(std::move(record));
+}
+
+int AuditSink::createSpillFile() {
+    int fd = -1;
+#ifdef O_TMPFILE
+    // Never visible in the directory
+    fd = open(spill_path_.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+#endif
+    if (fd < 0) {
+        std::string path = absl::StrCat(spill_path_, "/modsec-audit-XXXXXX");
+        fd = mkostemp(&path[0], O_CLOEXEC);
+        if (fd >= 0) {
+            unlink(path.c_str());
+        }
+    }
+    if (fd < 0) {
+        ENVOY_LOG(error, "Failed to create ModSecurity audit log spill file in {}: {}", spill_path_, strerror(errno));
+    }
+    return fd;
+}
+
+void AuditSink::redact(std::string& data) {
+    for (const auto& regex : redact_patterns_) {
+        const int redacted = re2::RE2::GlobalReplace(&data, *regex, Redacted);
+        if (redacted > 0) {
+            stats_.audit_redacted_.add(redacted);
+        }
+    }
+}
+
+void AuditSink::write(PendingAuditRecord& record) {
+    if (record.fd >= 0) {
+        writeSpilled(record);
+        release(record);
+        close(record.fd);
+        return;
+    }
+    if (output_fd_ < 0) {
+        ENVOY_LOG(warn, "{}", record.data);
+    } else if (!writeAll(output_fd_, record.data) || !writeAll(output_fd_, "\n")) {
+        ENVOY_LOG(error, "Failed to write ModSecurity audit log: {}", strerror(errno));
+        stats_.audit_dropped_.inc();
+        release(record);
+        return;
+    }
+    release(record);
+    stats_.audit_records_.inc();
+}
+
+void AuditSink::writeSpilled(PendingAuditRecord& record) {
+    if (output_fd_ >= 0) {
+        // Copied by the kernel, the record is never read back by us
+        off_t offset = 0;
+        while (static_cast<uint64_t>(offset) < record.size) {
+            const ssize_t rc = sendfile(output_fd_, record.fd, &offset, record.size - offset);
+            if (rc < 0 && errno == EINTR) {
+                continue;
+            }
+            if (rc <= 0) {
+                ENVOY_LOG(error, "Failed to write ModSecurity audit log: {}", strerror(errno));
+                stats_.audit_dropped_.inc();
+                return;
+            }
+        }
+        writeAll(output_fd_, "\n");
+        stats_.audit_records_.inc();
+        return;
+    }
+    // One log line per record, as for the records kept in memory. The mapping is only paged in as it is logged
+    void* data = mmap(nullptr, record.size, PROT_READ, MAP_PRIVATE, record.fd, 0);
+    if (data == MAP_FAILED) {
+        ENVOY_LOG(error, "Failed to map ModSecurity audit log spill file: {}", strerror(errno));
+        stats_.audit_dropped_.inc();
+        return;
+    }
+    madvise(data, record.size, MADV_SEQUENTIAL);
+    ENVOY_LOG(warn, "{}", absl::string_view(static_cast<const char*>(data), record.size));
+    munmap(data, record.size);
+    stats_.audit_records_.inc();
+}
+
+void drawAuditLogBoundary(std::mt19937_64& random, std::string& boundary) {
+    static const char alphanum[] =
+        "0123456789"
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+        "abcdefghijklmnopqrstuvwxyz";
+
+    std::uniform_int_distribution<size_t> distribution(0, sizeof(alphanum) - 2);
+    boundary.assign(1, '-');
+    for (int i = 0; i < 8; ++i) {
+        boundary.push_back(alphanum[distribution(random)]);
+    }
+    boundary.append("--");
+}
+
+AuditRecord::AuditRecord(AuditSink& sink, bool json, std::string&& modsec_record, const std::string& trailer)
+    : sink_(sink), json_(json), trailer_(trailer), modsec_record_(std::move(modsec_record)) {
+    sink_.redact(modsec_record_);
+}
+
+template <class ForEachHeader>
+void AuditRecord::addHeaderEntries(bool request, ForEachHeader for_each_header) {
+    std::string out = json_ ? "{" : "";
+    uint64_t remaining = sink_.maxHeadersBytes();
+    bool first = true;
+    for_each_header([this, &out, &remaining, &first](absl::string_view key, absl::string_view value) -> bool {
+        const bool redacted = sink_.redactHeader(key);
+        if (redacted) {
+            value = Redacted;
+        }
+        if (key.size() + value.size() > remaining) {
+            sink_.stats().audit_truncated_.inc();
+            return false;
+        }
+        remaining -= key.size() + value.size();
+        if (redacted) {
+            sink_.stats().audit_redacted_.inc();
+        }
+        appendHeader(out, first, key, value);
+        first = false;
+        return true;
+    });
+    out.append(json_ ? "}" : "\n");
+    direction(request).headers = std::move(out);
+}
+
+void AuditRecord::addHeaders(bool request, const HeaderMap* headers) {
+    if (headers == nullptr) {
+        return;
+    }
+    addHeaderEntries(request, [headers](auto fn) {
+        headers->iterate([&fn](const HeaderEntry& header) -> HeaderMap::Iterate {
+            return fn(header.key().getStringView(), header.value().getStringView()) ? HeaderMap::Iterate::Continue
+                                                                                    : HeaderMap::Iterate::Break;
+        });
+    });
+}
+
+void AuditRecord::addHeaders(bool request, const std::vector<std::pair<std::string, std::string>>& headers) {
+    addHeaderEntries(request, [&headers](auto fn) {
+        for (const auto& header : headers) {
+            if (!fn(header.first, header.second)) {
+                return;
+            }
+        }
+    });
+}
+
+template <class ForEachSlice>
+void AuditRecord::addBodySlices(bool request, uint64_t length, ForEachSlice for_each_slice) {
+    const uint64_t limit = std::min(length, sink_.maxBodyBytes(request));
+    if (length > limit) {
+        sink_.stats().audit_truncated_.inc();
+    }
+    std::string out = json_ ? "\"" : "";
+    out.reserve(limit + 2);
+    if (sink_.hasRedactPatterns()) {
+        // Patterns need contiguous input, bounded by the part limit
+        std::string window;
+        window.reserve(limit);
+        for_each_slice(limit, [&window](absl::string_view slice) { window.append(slice.data(), slice.size()); });
+        sink_.redact(window);
+        appendValue(out, window);
+    } else {
+        for_each_slice(limit, [this, &out](absl::string_view slice) { appendValue(out, slice); });
+    }
+    out.append(json_ ? "\"" : "\n");
+    direction(request).body = std::move(out);
+}
+
+void AuditRecord::addBody(bool request, const Buffer::Instance* buffered, const Buffer::Instance* current) {
+    const uint64_t length = (buffered != nullptr ? buffered->length() : 0) + (current != nullptr ? current->length() : 0);
+    addBodySlices(request, length, [buffered, current](uint64_t limit, auto fn) {
+        forEachSlice(buffered, current, limit, fn);
+    });
+}
+
+void AuditRecord::addBody(bool request, absl::string_view body) {
+    addBodySlices(request, body.size(), [body](uint64_t limit, auto fn) { fn(body.substr(0, limit)); });
+}
+
+void AuditRecord::commit() {
+    sink_.submit(json_ ? assembleJson() : assembleNative());
+}
+
+void AuditRecord::appendHeader(std::string& out, bool first, absl::string_view key, absl::string_view value) const {
+    if (json_) {
+        out.append(first ? "\"" : ",\"");
+        appendValue(out, key);
+        out.append("\":\"");
+        appendValue(out, value);
+        out.append("\"");
+    } else {
+        absl::StrAppend(&out, key, ": ", value, "\n");
+    }
+}
+
+std::string AuditRecord::jsonMembers(const Direction& direction) const {
+    std::string members;
+    if (direction.body) {
+        absl::StrAppend(&members, "\"body\":", *direction.body);
+    }
+    if (direction.headers) {
+        absl::StrAppend(&members, members.empty() ? "" : ",", "\"headers\":", *direction.headers);
+    }
+    return members;
+}
+
+std::string AuditRecord::assembleJson() const {
+    const std::string request = jsonMembers(request_);
+    const std::string response = jsonMembers(response_);
+    const JsonLayout layout = scanJson(modsec_record_);
+    if (layout.transaction_end == std::string::npos) {
+        // Unexpected layout, nest ModSecurity's record instead
+        return absl::StrCat("{\"modsecurity\":", modsec_record_, ",\"request\":{", request, "},\"response\":{",
+                            response, "}}");
+    }
+
+    // Members are added to ModSecurity's request and response objects, created if missing
+    std::vector<std::pair<size_t, std::string>> insertions;
+    auto insert = [this, &insertions, &layout](size_t end, const std::string& members, absl::string_view key) {
+        if (members.empty()) {
+            return;
+        }
+        if (end == std::string::npos) {
+            insertions.emplace_back(layout.transaction_end, absl::StrCat(",\"", key, "\":{", members, "}"));
+        } else {
+            insertions.emplace_back(end, absl::StrCat(emptyObject(modsec_record_, end) ? "" : ",", members));
+        }
+    };
+    insert(layout.request_end, request, "request");
+    insert(layout.response_end, response, "response");
+    std::stable_sort(insertions.begin(), insertions.end(),
+                     [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    std::string out;
+    out.reserve(modsec_record_.size() + request.size() + response.size() + 32);
+    size_t pos = 0;
+    for (const auto& insertion : insertions) {
+        out.append(modsec_record_, pos, insertion.first - pos);
+        out.append(insertion.second);
+        pos = insertion.first;
+    }
+    out.append(modsec_record_, pos, std::string::npos);
+    return out;
+}
+
+std::string AuditRecord::assembleNative() const {
+    std::string sections;
+    auto section = [this, &sections](char part, const absl::optional<std::string>& content) {
+        if (content) {
+            absl::StrAppend(&sections, "--", trailer_, "-", absl::string_view(&part, 1), "--\n", *content);
+        }
+    };
+    section('B', request_.headers);
+    section('C', request_.body);
+    section('E', response_.body);
+    section('F', response_.headers);
+    // Sections are added before part Z
+    size_t split = modsec_record_.rfind(absl::StrCat("--", trailer_, "-Z--"));
+    if (split == std::string::npos) {
+        split = modsec_record_.size();
+    }
+    return absl::StrCat(absl::string_view(modsec_record_).substr(0, split), sections,
+                        absl::string_view(modsec_record_).substr(split));
+}
+
+void AuditRecord::appendValue(std::string& out, absl::string_view data) const {
+    if (!json_) {
+        out.append(data.data(), data.size());
+        return;
+    }
+    size_t start = 0;
+    for (size_t i = 0; i < data.size(); i++) {
+        const unsigned char c = data[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        out.append(data.data() + start, i - start);
+        start = i + 1;
+        switch (c) {
+        case '"':
+            out.append("\\\"");
+            break;
+        case '\\':
+            out.append("\\\\");
+            break;
+        case '\n':
+            out.append("\\n");
+            break;
+        case '\r':
+            out.append("\\r");
+            break;
+        case '\t':
+            out.append("\\t");
+            break;
+        default:
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out.append(escaped);
+        }
+    }
+    out.append(data.data() + start, data.size() - start);
+}
+
+} // namespace Http
+} // namespace Envoy
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_set.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/optional.h"
+#include "common/common/logger.h"
+#include "envoy/api/api.h"
+#include "envoy/buffer/buffer.h"
+#include "envoy/http/header_map.h"
+#include "envoy/stats/scope.h"
+#include "envoy/stats/stats_macros.h"
+
+#include "http-filter-modsecurity/http_filter.pb.h"
+
+#include "re2/re2.h"
+
+#include "background_queue.h"
+
+namespace Envoy {
+namespace Http {
+
+/**
+ * All audit log stats. @see stats_macros.h
+ */
+#define ALL_MODSEC_AUDIT_STATS(COUNTER, GAUGE)                                                     \
+  COUNTER(audit_records)                                                                           \
+  COUNTER(audit_dropped)                                                                           \
+  COUNTER(audit_truncated)                                                                         \
+  COUNTER(audit_redacted)                                                                          \
+  COUNTER(audit_spilled)                                                                           \
+  GAUGE(audit_pending_bytes, Accumulate)
+
+/**
+ * Struct definition for all audit log stats. @see stats_macros.h
+ */
+struct ModSecurityAuditStats {
+  ALL_MODSEC_AUDIT_STATS(GENERATE_COUNTER_STRUCT, GENERATE_GAUGE_STRUCT)
+};
+
+/**
+ * A record waiting to be written, either in memory or, once moved there by the spill thread, in an unlinked
+ * temp file.
+ */
+struct PendingAuditRecord {
+  std::string data;
+  // Set if the record was spilled, owned by the record
+  int fd = -1;
+  uint64_t size = 0;
+};
+
+/**
+ * Writes audit log records on background threads, within a memory budget. Workers hand over records fully
+ * assembled in memory (see AuditRecord) and never touch the disk: records larger than spill_bytes are moved
+ * to temp files by a spill thread while they wait for the writer thread.
+ */
+class AuditSink : public Logger::Loggable<Logger::Id::filter> {
+public:
+  AuditSink(const envoy::config::filter::http::modsec::v2::AuditLog& proto_config, Api::Api& api,
+            Stats::Scope& scope);
+  ~AuditSink();
+
+  /**
+   * Enqueue a record. Never blocks, drops the record if it doesn't fit in the budget.
+   */
+  void submit(std::string&& record);
+
+  /**
+   * Replaces the matches of redact_patterns in place
+   */
+  void redact(std::string& data);
+
+  uint64_t maxBodyBytes(bool request) const {
+    return request ? max_request_body_bytes_ : max_response_body_bytes_;
+  }
+  uint64_t maxHeadersBytes() const { return max_headers_bytes_; }
+  bool redactHeader(absl::string_view name) const { return redact_headers_.contains(name); }
+  bool hasRedactPatterns() const { return !redact_patterns_.empty(); }
+
+  ModSecurityAuditStats& stats() { return stats_; }
+
+private:
+  // Spill thread
+  void spill(PendingAuditRecord& record);
+  // Writer thread
+  void write(PendingAuditRecord& record);
+  void writeSpilled(PendingAuditRecord& record);
+  /**
+   * @return a new unlinked temp file, -1 on failure
+   */
+  int createSpillFile();
+  // Hands a record to the writer thread, dropping it if the writer is stopped
+  void enqueue(PendingAuditRecord&& record);
+  // Gives the budget held by a pending record back
+  void release(const PendingAuditRecord& record);
+
+  const uint64_t max_request_body_bytes_;
+  const uint64_t max_response_body_bytes_;
+  const uint64_t max_headers_bytes_;
+  const uint64_t spill_bytes_;
+  const std::string spill_path_;
+  const uint64_t max_pending_bytes_;
+  const uint32_t max_pending_spills_;
+  absl::flat_hash_set<std::string> redact_headers_;
+  std::vector<std::unique_ptr<re2::RE2>> redact_patterns_;
+  ModSecurityAuditStats stats_;
+  std::atomic<uint64_t> pending_bytes_;
+  std::atomic<uint32_t> pending_spills_;
+  // Set if path is configured, records are written there instead of the envoy log
+  int output_fd_;
+  // Last, their threads use the members above. The spill thread feeds the writer thread
+  std::unique_ptr<BackgroundQueue<PendingAuditRecord>> writer_;
+  std::unique_ptr<BackgroundQueue<PendingAuditRecord>> spiller_;
+};
+
+typedef std::unique_ptr<AuditSink> AuditSinkPtr;
+
+/**
+ * Draws a new boundary for a native format record into boundary, reusing its storage
+ */
+void drawAuditLogBoundary(std::mt19937_64& random, std::string& boundary);
+
+/**
+ * One audit log record, assembled on the worker from ModSecurity's formatting of the parts it keeps
+ * (A, H, K...) and from the header maps and body slices envoy holds (parts B, C, E and F), each part
+ * bounded by its limit. JSON records keep ModSecurity's layout, these parts being added as "headers" and
+ * "body" of transaction.request and transaction.response.
+ */
+class AuditRecord {
+public:
+  /**
+   * @param json true for the JSON format, false for the native (serial) format
+   * @param modsec_record the record ModSecurity formatted, without the parts written by this class
+   * @param trailer the boundary ModSecurity's native record was formatted with
+   */
+  AuditRecord(AuditSink& sink, bool json, std::string&& modsec_record, const std::string& trailer);
+
+  /**
+   * Writes part B (request) or F (response). Nothing is written if headers is null.
+   */
+  void addHeaders(bool request, const HeaderMap* headers);
+  /**
+   * Same as above, from headers copied off the stream.
+   */
+  void addHeaders(bool request, const std::vector<std::pair<std::string, std::string>>& headers);
+  /**
+   * Writes part C (request) or E (response) from the body envoy buffered so far followed by the chunk
+   * being processed, both optional.
+   */
+  void addBody(bool request, const Buffer::Instance* buffered, const Buffer::Instance* current);
+  /**
+   * Same as above, from a body copied off the stream.
+   */
+  void addBody(bool request, absl::string_view body);
+  /**
+   * Hands the record over to the sink. The record must not be used anymore.
+   */
+  void commit();
+
+private:
+  // Parts of one direction, unset if not logged
+  struct Direction {
+    absl::optional<std::string> headers;
+    absl::optional<std::string> body;
+  };
+
+  Direction& direction(bool request) { return request ? request_ : response_; }
+  // for_each_header(fn) calls fn(key, value) for each header until it returns false
+  template <class ForEachHeader> void addHeaderEntries(bool request, ForEachHeader for_each_header);
+  // for_each_slice(limit, fn) calls fn(slice) for the first limit bytes of a body of length bytes
+  template <class ForEachSlice> void addBodySlices(bool request, uint64_t length, ForEachSlice for_each_slice);
+  // Escaped for JSON strings if the record is JSON
+  void appendValue(std::string& out, absl::string_view data) const;
+  void appendHeader(std::string& out, bool first, absl::string_view key, absl::string_view value) const;
+  // JSON members of a direction, "body":...,"headers":{...}
+  std::string jsonMembers(const Direction& direction) const;
+  std::string assembleJson() const;
+  std::string assembleNative() const;
+
+  AuditSink& sink_;
+  const bool json_;
+  const std::string trailer_;
+  std::string modsec_record_;
+  Direction request_;
+  Direction response_;
+};
+
+} // namespace Http
+} // namespace Envoy
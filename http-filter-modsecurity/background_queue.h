@@ -0,0 +1,138 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <utility>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "common/common/logger.h"
+#include "common/common/thread.h"
+#include "envoy/api/api.h"
+
+namespace Envoy {
+namespace Http {
+
+/**
+ * A queue drained in order by a dedicated thread, which the destructor stops and joins.
+ * Shared by the shadow rules, the inspection supervisor and the audit log.
+ */
+template <class T> class BackgroundQueue : public Logger::Loggable<Logger::Id::filter> {
+public:
+  struct Options {
+    // push() rejects items beyond this many pending
+    size_t max_pending = std::numeric_limits<size_t>::max();
+    // If set, called on the thread every tick_interval, between items
+    std::function<void()> tick;
+    std::chrono::milliseconds tick_interval{0};
+    // Only run when no other thread wants the cpu
+    bool idle_priority = false;
+    // Process the pending items before the thread exits, instead of discarding them
+    bool drain_on_shutdown = false;
+  };
+
+  BackgroundQueue(Api::Api& api, std::function<void(T&)> process, Options options)
+      : process_(std::move(process)), options_(std::move(options)), shutdown_(false) {
+    thread_ = api.threadFactory().createThread([this]() -> void { threadRoutine(); });
+  }
+
+  ~BackgroundQueue() { stop(); }
+
+  /**
+   * Never blocks.
+   * @return false if the item was rejected, the queue being full or stopped
+   */
+  bool push(T&& item) {
+    Thread::LockGuard lock(lock_);
+    if (shutdown_ || queue_.size() >= options_.max_pending) {
+      return false;
+    }
+    queue_.emplace_back(std::move(item));
+    cond_.notifyOne();
+    return true;
+  }
+
+  /**
+   * Stops and joins the thread, owners call it before destroying state the callbacks use
+   */
+  void stop() {
+    {
+      Thread::LockGuard lock(lock_);
+      shutdown_ = true;
+      cond_.notifyOne();
+    }
+    if (thread_) {
+      thread_->join();
+      thread_.reset();
+    }
+  }
+
+private:
+  void threadRoutine() {
+#ifdef __linux__
+    if (options_.idle_priority) {
+      struct sched_param param = {};
+      if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0) {
+        ENVOY_LOG(warn, "Failed to lower ModSecurity background thread priority");
+      }
+    }
+#endif
+    auto next_tick = std::chrono::steady_clock::now() + options_.tick_interval;
+    while (true) {
+      T item;
+      bool has_item = false;
+      {
+        Thread::LockGuard lock(lock_);
+        while (!shutdown_ && queue_.empty()) {
+          if (!options_.tick) {
+            cond_.wait(lock_);
+            continue;
+          }
+          const auto now = std::chrono::steady_clock::now();
+          if (now >= next_tick) {
+            break;
+          }
+          cond_.waitFor(lock_, std::chrono::duration_cast<std::chrono::microseconds>(next_tick - now));
+        }
+        if (shutdown_ && (!options_.drain_on_shutdown || queue_.empty())) {
+          return;
+        }
+        if (!queue_.empty()) {
+          item = std::move(queue_.front());
+          queue_.pop_front();
+          has_item = true;
+        }
+      }
+      if (has_item) {
+        process_(item);
+      }
+      if (options_.tick && std::chrono::steady_clock::now() >= next_tick) {
+        options_.tick();
+        next_tick = std::chrono::steady_clock::now() + options_.tick_interval;
+      }
+    }
+  }
+
+  const std::function<void(T&)> process_;
+  const Options options_;
+
+  Thread::MutexBasicLockable lock_;
+  Thread::CondVar cond_;
+  std::deque<T> queue_ ABSL_GUARDED_BY(lock_);
+  bool shutdown_ ABSL_GUARDED_BY(lock_);
+  Thread::ThreadPtr thread_;
+};
+
+/**
+ * A thread only running the tick of its options, nothing is pushed to it
+ */
+using BackgroundTicker = BackgroundQueue<std::nullptr_t>;
+
+} // namespace Http
+} // namespace Envoy
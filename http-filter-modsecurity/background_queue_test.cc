@@ -0,0 +1,94 @@
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "absl/synchronization/notification.h"
+
+#include "background_queue.h"
+
+#include "test/test_common/utility.h"
+
+#include "gtest/gtest.h"
+
+namespace Envoy {
+namespace Http {
+namespace {
+
+class BackgroundQueueTest : public testing::Test {
+public:
+  BackgroundQueueTest() : api_(Api::createApiForTest()) {}
+
+  // Processes items in a vector, the first one blocks until release_ is notified
+  std::unique_ptr<BackgroundQueue<int>> createQueue(BackgroundQueue<int>::Options options) {
+    return std::make_unique<BackgroundQueue<int>>(
+        *api_,
+        [this](int& item) -> void {
+          if (processed_.empty()) {
+            started_.Notify();
+            release_.WaitForNotification();
+          }
+          processed_.push_back(item);
+        },
+        std::move(options));
+  }
+
+  Api::ApiPtr api_;
+  absl::Notification started_;
+  absl::Notification release_;
+  std::vector<int> processed_;
+};
+
+TEST_F(BackgroundQueueTest, ProcessesInOrder) {
+  BackgroundQueue<int>::Options options;
+  options.drain_on_shutdown = true;
+  auto queue = createQueue(std::move(options));
+  for (int i = 0; i < 5; i++) {
+    EXPECT_TRUE(queue->push(int(i)));
+  }
+  release_.Notify();
+  queue->stop();
+  EXPECT_EQ(std::vector<int>({0, 1, 2, 3, 4}), processed_);
+}
+
+// Items being processed don't count, only the pending ones
+TEST_F(BackgroundQueueTest, RejectsBeyondMaxPending) {
+  BackgroundQueue<int>::Options options;
+  options.max_pending = 2;
+  options.drain_on_shutdown = true;
+  auto queue = createQueue(std::move(options));
+  EXPECT_TRUE(queue->push(1));
+  started_.WaitForNotification();
+  EXPECT_TRUE(queue->push(2));
+  EXPECT_TRUE(queue->push(3));
+  EXPECT_FALSE(queue->push(4));
+  release_.Notify();
+  queue->stop();
+  EXPECT_EQ(std::vector<int>({1, 2, 3}), processed_);
+}
+
+TEST_F(BackgroundQueueTest, RejectsAfterStop) {
+  auto queue = createQueue(BackgroundQueue<int>::Options());
+  queue->stop();
+  EXPECT_FALSE(queue->push(1));
+  // Idempotent
+  queue->stop();
+  EXPECT_TRUE(processed_.empty());
+}
+
+TEST_F(BackgroundQueueTest, DiscardsPendingOnShutdown) {
+  auto queue = createQueue(BackgroundQueue<int>::Options());
+  EXPECT_TRUE(queue->push(1));
+  started_.WaitForNotification();
+  EXPECT_TRUE(queue->push(2));
+  std::thread stopper([&queue]() { queue->stop(); });
+  // The stopping thread rejects pushes once shut down
+  while (queue->push(3)) {
+  }
+  release_.Notify();
+  stopper.join();
+  EXPECT_EQ(std::vector<int>({1}), processed_);
+}
+
+} // namespace
+} // namespace Http
+} // namespace Envoy
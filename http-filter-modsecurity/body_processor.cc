@@ -0,0 +1,575 @@
+#include "body_processor.h"
+
+#include <cstring>
+
+#include "modsecurity/rules.h"
+
+namespace Envoy {
+namespace Http {
+
+namespace {
+
+bool isHex(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+unsigned int hexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return c - 'A' + 10;
+}
+
+bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// yajl also accepts \v and \f
+bool isJsonWhitespace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Same encoding as yajl's Utf32toUtf8, quirks included (0xFFFF is encoded on 4 bytes)
+void appendUtf8(unsigned int codepoint, std::string& out) {
+    if (codepoint < 0x80) {
+        out.push_back(static_cast<char>(codepoint));
+    } else if (codepoint < 0x0800) {
+        out.push_back(static_cast<char>((codepoint >> 6) | 0xC0));
+        out.push_back(static_cast<char>((codepoint & 0x3F) | 0x80));
+    } else if (codepoint < 0xFFFF) {
+        out.push_back(static_cast<char>((codepoint >> 12) | 0xE0));
+        out.push_back(static_cast<char>(((codepoint >> 6) & 0x3F) | 0x80));
+        out.push_back(static_cast<char>((codepoint & 0x3F) | 0x80));
+    } else if (codepoint < 0x200000) {
+        out.push_back(static_cast<char>((codepoint >> 18) | 0xF0));
+        out.push_back(static_cast<char>(((codepoint >> 12) & 0x3F) | 0x80));
+        out.push_back(static_cast<char>(((codepoint >> 6) & 0x3F) | 0x80));
+        out.push_back(static_cast<char>((codepoint & 0x3F) | 0x80));
+    } else {
+        out.push_back('?');
+    }
+}
+
+unsigned int hexToCodepoint(const char* hex) {
+    return (hexValue(hex[0]) << 12) | (hexValue(hex[1]) << 8) | (hexValue(hex[2]) << 4) | hexValue(hex[3]);
+}
+
+// Same checks as Transaction::processRequestBody, which doesn't touch the body when they fail
+bool requestBodyAccess(modsecurity::Transaction& transaction) {
+    if (transaction.getRuleEngineState() == modsecurity::Rules::DisabledRuleEngine) {
+        return false;
+    }
+    if (transaction.m_rules->m_secRequestBodyAccess != modsecurity::Rules::TrueConfigBoolean) {
+        // Unless enabled by ctl:requestBodyAccess=On
+        return transaction.m_requestBodyAccess == modsecurity::Rules::TrueConfigBoolean;
+    }
+    // Unless disabled by ctl:requestBodyAccess=Off
+    return transaction.m_requestBodyAccess != modsecurity::Rules::FalseConfigBoolean;
+}
+
+} // namespace
+
+FormArgumentsParser::FormArgumentsParser(char separator)
+    : separator_(separator), offset_(0), invalid_encoding_(false) {
+}
+
+bool FormArgumentsParser::parse(const char* data, size_t length) {
+    const char* end = data + length;
+    while (data < end) {
+        const char* separator = static_cast<const char*>(memchr(data, separator_, end - data));
+        if (separator == nullptr) {
+            pending_.append(data, end - data);
+            return true;
+        }
+        pending_.append(data, separator - data);
+        addPair(pending_);
+        pending_.clear();
+        data = separator + 1;
+    }
+    return true;
+}
+
+bool FormArgumentsParser::finish() {
+    // As the built-in processor (std::getline), a trailing empty pair is not an argument
+    if (!pending_.empty()) {
+        addPair(pending_);
+        pending_.clear();
+    }
+    return true;
+}
+
+void FormArgumentsParser::addPair(const std::string& pair) {
+    const size_t equal = pair.find('=');
+    if (equal == std::string::npos) {
+        arguments_.push_back({decode(pair), "", offset_});
+    } else {
+        arguments_.push_back({decode(pair.substr(0, equal)), decode(pair.substr(equal + 1)), offset_});
+    }
+    offset_ += pair.size() + 1;
+}
+
+// Same as libmodsecurity's urldecode_nonstrict_inplace
+std::string FormArgumentsParser::decode(const std::string& encoded) {
+    std::string decoded;
+    decoded.reserve(encoded.size());
+    const size_t length = encoded.size();
+    for (size_t i = 0; i < length;) {
+        const char c = encoded[i];
+        if (c == '%') {
+            if (i + 2 < length && isHex(encoded[i + 1]) && isHex(encoded[i + 2])) {
+                decoded.push_back(static_cast<char>((hexValue(encoded[i + 1]) << 4) | hexValue(encoded[i + 2])));
+                i += 3;
+            } else {
+                // Not a valid encoding, keep the %
+                decoded.push_back(c);
+                invalid_encoding_ = true;
+                i++;
+            }
+        } else {
+            decoded.push_back(c == '+' ? ' ' : c);
+            i++;
+        }
+    }
+    return decoded;
+}
+
+JsonArgumentsParser::JsonArgumentsParser()
+    : state_(State::Value), string_is_key_(false), unicode_digits_(0), utf8_remaining_(0) {
+}
+
+bool JsonArgumentsParser::parse(const char* data, size_t length) {
+    const char* end = data + length;
+    while (data < end) {
+        if (state_ == State::String || state_ == State::Escape || state_ == State::Unicode) {
+            if (!scanString(data, end)) {
+                state_ = State::Error;
+                return false;
+            }
+            continue;
+        }
+        if (!parseChar(*data++)) {
+            state_ = State::Error;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool JsonArgumentsParser::finish() {
+    if (state_ == State::Number && !endNumber()) {
+        return false;
+    }
+    if (state_ == State::Literal && !endLiteral()) {
+        return false;
+    }
+    return state_ == State::Done;
+}
+
+bool JsonArgumentsParser::scanString(const char*& data, const char* end) {
+    while (data < end) {
+        if (state_ == State::Escape) {
+            const char c = *data++;
+            token_.push_back(c);
+            if (c == 'u') {
+                unicode_digits_ = 0;
+                state_ = State::Unicode;
+            } else if (c == '"' || c == '\\' || c == '/' || c == 'b' || c == 'f' || c == 'n' || c == 'r' || c == 't') {
+                state_ = State::String;
+            } else {
+                return false;
+            }
+            continue;
+        }
+        if (state_ == State::Unicode) {
+            const char c = *data++;
+            if (!isHex(c)) {
+                return false;
+            }
+            token_.push_back(c);
+            if (++unicode_digits_ == 4) {
+                state_ = State::String;
+            }
+            continue;
+        }
+
+        // Plain characters run until the next quote or backslash
+        const char* quote = static_cast<const char*>(memchr(data, '"', end - data));
+        const char* stop = quote != nullptr ? quote : end;
+        const char* backslash = static_cast<const char*>(memchr(data, '\\', stop - data));
+        if (backslash != nullptr) {
+            stop = backslash;
+        }
+        for (const char* p = data; p < stop; p++) {
+            const unsigned char c = static_cast<unsigned char>(*p);
+            if (utf8_remaining_ > 0) {
+                if ((c >> 6) != 0x2) {
+                    return false;
+                }
+                utf8_remaining_--;
+            } else if (c < 0x20) {
+                return false;
+            } else if (c >= 0x80) {
+                if ((c >> 5) == 0x6) {
+                    utf8_remaining_ = 1;
+                } else if ((c >> 4) == 0xE) {
+                    utf8_remaining_ = 2;
+                } else if ((c >> 3) == 0x1E) {
+                    utf8_remaining_ = 3;
+                } else {
+                    return false;
+                }
+            }
+        }
+        token_.append(data, stop - data);
+        data = stop;
+        if (data == end) {
+            return true;
+        }
+        if (utf8_remaining_ > 0) {
+            return false;
+        }
+        if (*data++ == '"') {
+            return endString();
+        }
+        token_.push_back('\\');
+        state_ = State::Escape;
+    }
+    return true;
+}
+
+bool JsonArgumentsParser::parseChar(char c) {
+    if (state_ == State::Number) {
+        if (isDigit(c) || c == '.' || c == 'e' || c == 'E' || c == '+' || c == '-') {
+            token_.push_back(c);
+            return true;
+        }
+        if (!endNumber()) {
+            return false;
+        }
+    } else if (state_ == State::Literal) {
+        if (c >= 'a' && c <= 'z') {
+            token_.push_back(c);
+            return token_.size() <= 5;
+        }
+        if (!endLiteral()) {
+            return false;
+        }
+    }
+
+    if (isJsonWhitespace(c)) {
+        return state_ != State::Error;
+    }
+    switch (state_) {
+    case State::Value:
+    case State::ValueOrEnd:
+        if (c == ']' && state_ == State::ValueOrEnd) {
+            return endContainer(true);
+        }
+        if (c == '{' || c == '[') {
+            return startContainer(c == '[');
+        }
+        if (c == '"') {
+            token_.clear();
+            string_is_key_ = false;
+            state_ = State::String;
+            return true;
+        }
+        if (c == '-' || isDigit(c)) {
+            token_.assign(1, c);
+            state_ = State::Number;
+            return true;
+        }
+        if (c == 't' || c == 'f' || c == 'n') {
+            token_.assign(1, c);
+            state_ = State::Literal;
+            return true;
+        }
+        return false;
+    case State::KeyOrEnd:
+    case State::Key:
+        if (c == '}' && state_ == State::KeyOrEnd) {
+            return endContainer(false);
+        }
+        if (c == '"') {
+            token_.clear();
+            string_is_key_ = true;
+            state_ = State::String;
+            return true;
+        }
+        return false;
+    case State::Colon:
+        if (c == ':') {
+            state_ = State::Value;
+            return true;
+        }
+        return false;
+    case State::CommaOrEnd:
+        if (c == ',') {
+            state_ = containers_.back().array ? State::Value : State::Key;
+            return true;
+        }
+        if (c == ']' || c == '}') {
+            return endContainer(c == ']');
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+bool JsonArgumentsParser::endString() {
+    const std::string value = unescape(token_);
+    token_.clear();
+    if (string_is_key_) {
+        current_key_ = value;
+        state_ = State::Colon;
+        return true;
+    }
+    addArgument(value);
+    return valueDone();
+}
+
+bool JsonArgumentsParser::endNumber() {
+    if (!validNumber()) {
+        return false;
+    }
+    // Numbers are reported as they are written
+    addArgument(token_);
+    token_.clear();
+    return valueDone();
+}
+
+bool JsonArgumentsParser::endLiteral() {
+    if (token_ == "true" || token_ == "false") {
+        addArgument(token_);
+    } else if (token_ == "null") {
+        addArgument("");
+    } else {
+        return false;
+    }
+    token_.clear();
+    return valueDone();
+}
+
+bool JsonArgumentsParser::startContainer(bool array) {
+    containers_.push_back({array, currentKey(true), 0});
+    state_ = array ? State::ValueOrEnd : State::KeyOrEnd;
+    return true;
+}
+
+bool JsonArgumentsParser::endContainer(bool array) {
+    if (containers_.empty() || containers_.back().array != array) {
+        return false;
+    }
+    containers_.pop_back();
+    if (!containers_.empty() && containers_.back().array) {
+        containers_.back().counter++;
+    }
+    return valueDone();
+}
+
+bool JsonArgumentsParser::valueDone() {
+    state_ = containers_.empty() ? State::Done : State::CommaOrEnd;
+    return true;
+}
+
+// Same naming as libmodsecurity's JSON::addArgument
+void JsonArgumentsParser::addArgument(const std::string& value) {
+    std::string path;
+    for (const Container& container : containers_) {
+        path.append(container.name);
+        if (container.array) {
+            path.append(".array_").append(std::to_string(container.counter));
+        } else {
+            path.push_back('.');
+        }
+    }
+    std::string data;
+    if (!containers_.empty() && containers_.back().array) {
+        containers_.back().counter++;
+    } else {
+        data = currentKey(false);
+    }
+    arguments_.push_back({path + data, value, 0});
+}
+
+// Same as libmodsecurity's JSON::getCurrentKey
+std::string JsonArgumentsParser::currentKey(bool empty_is_null) const {
+    if (containers_.empty()) {
+        return "json";
+    }
+    if (current_key_.empty()) {
+        if (containers_.back().array || !empty_is_null) {
+            return "empty-key";
+        }
+        return "";
+    }
+    return current_key_;
+}
+
+// Same as yajl_string_decode, quirks included: a lone high surrogate becomes '?' and swallows the next character
+std::string JsonArgumentsParser::unescape(const std::string& raw) const {
+    if (raw.find('\\') == std::string::npos) {
+        return raw;
+    }
+    std::string value;
+    value.reserve(raw.size());
+    const size_t length = raw.size();
+    size_t i = 0;
+    while (i < length) {
+        if (raw[i] != '\\') {
+            value.push_back(raw[i++]);
+            continue;
+        }
+        const char escaped = raw[i + 1];
+        i += 2;
+        switch (escaped) {
+        case 'b': value.push_back('\b'); break;
+        case 'f': value.push_back('\f'); break;
+        case 'n': value.push_back('\n'); break;
+        case 'r': value.push_back('\r'); break;
+        case 't': value.push_back('\t'); break;
+        case 'u': {
+            unsigned int codepoint = hexToCodepoint(&raw[i]);
+            i += 4;
+            if ((codepoint & 0xFC00) == 0xD800) {
+                if (i + 1 < length && raw[i] == '\\' && raw[i + 1] == 'u') {
+                    const unsigned int surrogate = hexToCodepoint(&raw[i + 2]);
+                    codepoint = ((codepoint & 0x3F) << 10) | ((((codepoint >> 6) & 0xF) + 1) << 16) |
+                                (surrogate & 0x3FF);
+                    i += 6;
+                } else {
+                    value.push_back('?');
+                    i++;
+                    break;
+                }
+            }
+            appendUtf8(codepoint, value);
+            break;
+        }
+        default:
+            // '"', '\\' and '/'
+            value.push_back(escaped);
+            break;
+        }
+    }
+    return value;
+}
+
+// -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+bool JsonArgumentsParser::validNumber() const {
+    const size_t length = token_.size();
+    size_t i = 0;
+    if (i < length && token_[i] == '-') {
+        i++;
+    }
+    if (i >= length || !isDigit(token_[i])) {
+        return false;
+    }
+    if (token_[i] == '0') {
+        i++;
+    } else {
+        while (i < length && isDigit(token_[i])) {
+            i++;
+        }
+    }
+    if (i < length && token_[i] == '.') {
+        i++;
+        if (i >= length || !isDigit(token_[i])) {
+            return false;
+        }
+        while (i < length && isDigit(token_[i])) {
+            i++;
+        }
+    }
+    if (i < length && (token_[i] == 'e' || token_[i] == 'E')) {
+        i++;
+        if (i < length && (token_[i] == '+' || token_[i] == '-')) {
+            i++;
+        }
+        if (i >= length || !isDigit(token_[i])) {
+            return false;
+        }
+        while (i < length && isDigit(token_[i])) {
+            i++;
+        }
+    }
+    return i == length;
+}
+
+BodyArgumentsProcessor::BodyArgumentsProcessor(modsecurity::Transaction& transaction,
+                                               std::unique_ptr<BodyArgumentsParser> parser, bool form)
+    : transaction_(transaction), parser_(std::move(parser)), form_(form), failed_(false), length_(0),
+      body_type_(transaction.m_requestBodyType), body_processor_(transaction.m_requestBodyProcessor) {
+    // Disable the built-in processor, see finish()
+    transaction_.m_requestBodyType = modsecurity::Transaction::UnknownFormat;
+    transaction_.m_requestBodyProcessor = modsecurity::Transaction::UnknownFormat;
+}
+
+std::unique_ptr<BodyArgumentsProcessor> BodyArgumentsProcessor::create(modsecurity::Transaction& transaction) {
+    // The body type is set from the Content-Type whatever the body access
+    if (!requestBodyAccess(transaction)) {
+        return nullptr;
+    }
+    // Same precedence as Transaction::processRequestBody
+    if (transaction.m_requestBodyProcessor == modsecurity::Transaction::XMLRequestBody) {
+        return nullptr;
+    }
+    if (transaction.m_requestBodyProcessor == modsecurity::Transaction::JSONRequestBody) {
+        return std::unique_ptr<BodyArgumentsProcessor>(
+            new BodyArgumentsProcessor(transaction, std::make_unique<JsonArgumentsParser>(), false));
+    }
+    if (transaction.m_requestBodyType == modsecurity::Transaction::WWWFormUrlEncoded) {
+        char separator = '&';
+        if (transaction.m_rules->m_secArgumentSeparator.m_set) {
+            separator = transaction.m_rules->m_secArgumentSeparator.m_value.at(0);
+        }
+        return std::unique_ptr<BodyArgumentsProcessor>(
+            new BodyArgumentsProcessor(transaction, std::make_unique<FormArgumentsParser>(separator), true));
+    }
+    return nullptr;
+}
+
+void BodyArgumentsProcessor::append(const char* data, size_t length) {
+    if (failed_ || length == 0) {
+        return;
+    }
+    length_ += length;
+    if (!parser_->parse(data, length)) {
+        // The built-in processor reports the error
+        failed_ = true;
+    }
+}
+
+void BodyArgumentsProcessor::finish() {
+    if (failed_ || length_ == 0 || !parser_->finish()) {
+        transaction_.m_requestBodyType = body_type_;
+        transaction_.m_requestBodyProcessor = body_processor_;
+        return;
+    }
+    if (form_) {
+        // Variables the built-in urlencoded processor sets along the arguments
+        transaction_.m_variableOffset++;
+        transaction_.m_variableRequestBodyLength.set(std::to_string(length_), transaction_.m_variableOffset);
+        if (static_cast<FormArgumentsParser*>(parser_.get())->invalidEncoding()) {
+            transaction_.m_variableUrlEncodedError.set("1", transaction_.m_variableOffset);
+        }
+        const size_t offset = transaction_.m_variableOffset;
+        for (const BodyArgument& argument : parser_->arguments()) {
+            transaction_.addArgument("POST", argument.key, argument.value, offset + argument.offset);
+        }
+    } else {
+        for (const BodyArgument& argument : parser_->arguments()) {
+            transaction_.addArgument("JSON", argument.key, argument.value, argument.offset);
+        }
+        // As the built-in JSON processor does on success
+        transaction_.m_variableReqbodyError.set("0", transaction_.m_variableOffset);
+        transaction_.m_variableReqbodyProcessorError.set("0", transaction_.m_variableOffset);
+    }
+}
+
+} // namespace Http
+} // namespace Envoy
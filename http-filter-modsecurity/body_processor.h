@@ -0,0 +1,182 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "modsecurity/transaction.h"
+
+namespace Envoy {
+namespace Http {
+
+/**
+ * An argument extracted from a request body
+ */
+struct BodyArgument {
+  std::string key;
+  std::string value;
+  size_t offset;
+};
+
+/**
+ * Incremental parser of a request body into arguments, fed with body slices as they arrive.
+ */
+class BodyArgumentsParser {
+public:
+  virtual ~BodyArgumentsParser() = default;
+
+  /**
+   * @return false once the body is known to be malformed
+   */
+  virtual bool parse(const char* data, size_t length) = 0;
+
+  /**
+   * Called once the whole body was parsed.
+   * @return false if the body is malformed
+   */
+  virtual bool finish() = 0;
+
+  const std::vector<BodyArgument>& arguments() const { return arguments_; }
+
+protected:
+  std::vector<BodyArgument> arguments_;
+};
+
+/**
+ * application/x-www-form-urlencoded bodies. Arguments are named as libmodsecurity's built-in processor does.
+ */
+class FormArgumentsParser : public BodyArgumentsParser {
+public:
+  /**
+   * Argument offsets are relative to the start of the body.
+   */
+  explicit FormArgumentsParser(char separator);
+
+  // BodyArgumentsParser
+  bool parse(const char* data, size_t length) override;
+  bool finish() override;
+
+  /**
+   * @return true if a malformed %-encoding was seen (URLENCODED_ERROR)
+   */
+  bool invalidEncoding() const { return invalid_encoding_; }
+
+private:
+  void addPair(const std::string& pair);
+  std::string decode(const std::string& encoded);
+
+  const char separator_;
+  // Offset of the current pair
+  size_t offset_;
+  // Current pair, when it spans several slices
+  std::string pending_;
+  bool invalid_encoding_;
+};
+
+/**
+ * application/json bodies. Arguments are named as libmodsecurity's built-in (yajl) processor does,
+ * e.g. json.a.b, json.a.array_0. Accepts exactly what yajl accepts with its default configuration.
+ */
+class JsonArgumentsParser : public BodyArgumentsParser {
+public:
+  JsonArgumentsParser();
+
+  // BodyArgumentsParser
+  bool parse(const char* data, size_t length) override;
+  bool finish() override;
+
+private:
+  enum class State {
+    Value,           // a value is expected
+    ValueOrEnd,      // a value or ']' is expected (start of an array)
+    KeyOrEnd,        // a key or '}' is expected (start of an object)
+    Key,             // a key is expected (after ',')
+    Colon,           // ':' is expected after a key
+    CommaOrEnd,      // ',' or the end of the current container is expected
+    String,          // inside a string
+    Escape,          // after '\' inside a string
+    Unicode,         // inside a \uXXXX escape
+    Number,          // inside a number
+    Literal,         // inside true, false or null
+    Done,            // the top level value is complete, only whitespace is allowed
+    Error,
+  };
+
+  struct Container {
+    bool array;
+    std::string name;
+    size_t counter;
+  };
+
+  bool parseChar(char c);
+  bool scanString(const char*& data, const char* end);
+  bool endString();
+  bool endNumber();
+  bool endLiteral();
+  bool startContainer(bool array);
+  bool endContainer(bool array);
+  bool valueDone();
+  void addArgument(const std::string& value);
+  std::string currentKey(bool empty_is_null) const;
+  std::string unescape(const std::string& raw) const;
+  bool validNumber() const;
+
+  State state_;
+  // Whether the string being parsed is an object key
+  bool string_is_key_;
+  // Raw (still escaped) string, number or literal being parsed
+  std::string token_;
+  size_t unicode_digits_;
+  // Remaining continuation bytes of the current utf-8 sequence
+  size_t utf8_remaining_;
+  std::vector<Container> containers_;
+  std::string current_key_;
+};
+
+/**
+ * Replaces libmodsecurity's built-in JSON / urlencoded request body processors with incremental parsers.
+ *
+ * Arguments are extracted as the body slices are appended, and only added to the transaction once the whole body
+ * parsed successfully. If the body is malformed, or was never appended, the built-in processor runs instead so that
+ * ARGS and the body error variables are identical to what libmodsecurity produces on its own.
+ */
+class BodyArgumentsProcessor {
+public:
+  /**
+   * To be called after processRequestHeaders, once the transaction's body processor is known.
+   * @return nullptr if the request body isn't accessed (SecRequestBodyAccess, ctl:requestBodyAccess), or if the
+   * transaction uses neither the JSON nor the urlencoded body processor.
+   * Otherwise the built-in processor is disabled until finish().
+   */
+  static std::unique_ptr<BodyArgumentsProcessor> create(modsecurity::Transaction& transaction);
+
+  /**
+   * Feeds body bytes, only those actually appended to the transaction (appendRequestBody may truncate).
+   */
+  void append(const char* data, size_t length);
+
+  /**
+   * Adds the extracted arguments to the transaction, or gives the body back to the built-in processor.
+   * To be called right before processRequestBody.
+   */
+  void finish();
+
+private:
+  BodyArgumentsProcessor(modsecurity::Transaction& transaction, std::unique_ptr<BodyArgumentsParser> parser,
+                         bool form);
+
+  modsecurity::Transaction& transaction_;
+  std::unique_ptr<BodyArgumentsParser> parser_;
+  const bool form_;
+  bool failed_;
+  size_t length_;
+  // The built-in processor settings, restored when falling back
+  const modsecurity::Transaction::RequestBodyType body_type_;
+  const modsecurity::Transaction::RequestBodyType body_processor_;
+};
+
+typedef std::unique_ptr<BodyArgumentsProcessor> BodyArgumentsProcessorPtr;
+
+} // namespace Http
+} // namespace Envoy
@@ -0,0 +1,231 @@
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "body_processor.h"
+
+#include "modsecurity/modsecurity.h"
+#include "modsecurity/rules.h"
+#include "modsecurity/transaction.h"
+#include "modsecurity/variable_value.h"
+
+#include "gtest/gtest.h"
+
+namespace Envoy {
+namespace Http {
+namespace {
+
+// Same setup as the CRS: JSON bodies go through the JSON processor
+const char* Rules = R"(
+SecRuleEngine On
+SecRequestBodyAccess On
+SecRule REQUEST_HEADERS:Content-Type "application/json" "id:200001,phase:1,t:none,t:lowercase,pass,nolog,ctl:requestBodyProcessor=JSON"
+)";
+
+// ARGS, then the REQBODY_* variables
+typedef std::vector<std::pair<std::string, std::string>> Arguments;
+
+class BodyProcessorTest : public testing::Test {
+public:
+  BodyProcessorTest() : modsec_(new modsecurity::ModSecurity()), rules_(new modsecurity::Rules()) {
+    EXPECT_GE(rules_->load(Rules), 0) << rules_->getParserError();
+  }
+
+  std::unique_ptr<modsecurity::Transaction> startTransaction(const std::string& content_type,
+                                                             modsecurity::Rules* rules = nullptr) {
+    std::unique_ptr<modsecurity::Transaction> transaction(
+        new modsecurity::Transaction(modsec_.get(), rules != nullptr ? rules : rules_.get(), nullptr));
+    transaction->processConnection("127.0.0.1", 12345, "127.0.0.1", 80);
+    transaction->processURI("/", "POST", "1.1");
+    transaction->addRequestHeader("Content-Type", content_type);
+    transaction->processRequestHeaders();
+    return transaction;
+  }
+
+  Arguments arguments(modsecurity::Transaction& transaction) {
+    std::vector<const modsecurity::VariableValue*> values;
+    transaction.m_variableArgs.resolve(&values);
+    Arguments result;
+    for (const modsecurity::VariableValue* value : values) {
+      result.emplace_back(value->getKey(), value->getValue());
+      delete value;
+    }
+    std::sort(result.begin(), result.end());
+    addVariable(result, "REQBODY_ERROR", transaction.m_variableReqbodyError);
+    addVariable(result, "REQBODY_ERROR_MSG", transaction.m_variableReqbodyErrorMsg);
+    addVariable(result, "REQBODY_PROCESSOR_ERROR", transaction.m_variableReqbodyProcessorError);
+    addVariable(result, "REQBODY_PROCESSOR_ERROR_MSG", transaction.m_variableReqbodyProcessorErrorMsg);
+    return result;
+  }
+
+  void addVariable(Arguments& result, const std::string& name, modsecurity::AnchoredVariable& variable) {
+    std::unique_ptr<std::string> value = variable.resolveFirst();
+    result.emplace_back(name, value != nullptr ? *value : "<unset>");
+  }
+
+  std::unique_ptr<modsecurity::Rules> loadRules(const char* rules) {
+    std::unique_ptr<modsecurity::Rules> result(new modsecurity::Rules());
+    EXPECT_GE(result->load(rules), 0) << result->getParserError();
+    return result;
+  }
+
+  // ARGS as extracted by the built-in processor
+  Arguments builtin(const std::string& content_type, const std::string& body) {
+    auto transaction = startTransaction(content_type);
+    transaction->appendRequestBody(reinterpret_cast<const unsigned char*>(body.data()), body.size());
+    transaction->processRequestBody();
+    return arguments(*transaction);
+  }
+
+  // ARGS as extracted by BodyArgumentsProcessor, fed with chunks of chunk_size bytes
+  Arguments fast(const std::string& content_type, const std::string& body, size_t chunk_size) {
+    auto transaction = startTransaction(content_type);
+    BodyArgumentsProcessorPtr processor = BodyArgumentsProcessor::create(*transaction);
+    EXPECT_NE(nullptr, processor);
+    for (size_t i = 0; i < body.size(); i += chunk_size) {
+      const size_t length = std::min(chunk_size, body.size() - i);
+      transaction->appendRequestBody(reinterpret_cast<const unsigned char*>(body.data() + i), length);
+      processor->append(body.data() + i, length);
+    }
+    processor->finish();
+    transaction->processRequestBody();
+    return arguments(*transaction);
+  }
+
+  void expectSameArguments(const std::string& content_type, const std::vector<std::string>& corpus) {
+    for (const std::string& body : corpus) {
+      const Arguments expected = builtin(content_type, body);
+      for (size_t chunk_size : {size_t(1), size_t(2), size_t(3), size_t(7), body.size() + 1}) {
+        EXPECT_EQ(expected, fast(content_type, body, chunk_size)) << "body: " << body << ", chunks: " << chunk_size;
+      }
+    }
+  }
+
+  std::unique_ptr<modsecurity::ModSecurity> modsec_;
+  std::unique_ptr<modsecurity::Rules> rules_;
+};
+
+TEST_F(BodyProcessorTest, JsonMatchesBuiltin) {
+  expectSameArguments("application/json", {
+      R"({"a":"b"})",
+      R"({"a":{"b":{"c":"d"}},"e":"f"})",
+      R"({"a":[1,2,[3,4,{"b":5}],{"c":[]},{}],"d":6})",
+      R"([[1,2],[3,[4,5]],"x"])",
+      R"({"":"empty","a":{"":1},"b":[{"":2}]})",
+      R"({"n":[0,-0,1.5,-12.25e10,3E-2,4e+7,123456789012345678901234567890]})",
+      R"({"t":true,"f":false,"n":null})",
+      R"("top level string")",
+      "42",
+      "null",
+      " \t\r\n\v\f{ \"a\" : [ 1 , 2 ] } \n",
+      R"({"esc":"\"\\\/\b\f\n\r\t","u":"\u0041\u00e9\u20ac\uFFFF\u0000x"})",
+      R"({"pair":"\ud83d\ude00","lone":"\ud800abc","lone_end":"\udbff"})",
+      "{\"utf8\":\"h\xc3\xa9llo \xe2\x82\xac \xf0\x9f\x98\x80\"}",
+      R"({"a":"first","a":"second"})",
+      R"({"key with spaces":{"and.dots":"v"}})",
+      // Malformed bodies are handed back to the built-in processor
+      R"({"a":1,})",
+      R"({"a":[1,2)",
+      R"({"a":01})",
+      R"({"a":1.})",
+      R"({"a":-})",
+      R"({"a":1e})",
+      R"({"a":tru})",
+      R"({"a":truex})",
+      R"({"a":"b"}{"c":"d"})",
+      R"([1]x)",
+      R"({"a" "b"})",
+      R"({a:1})",
+      R"({"a":"\x"})",
+      R"({"a":"\u12G4"})",
+      "{\"a\":\"tab\there\"}",
+      "{\"a\":\"\xc3\"}",
+      "{\"a\":\"\xff\"}",
+      "{\"a\":\"\x80\"}",
+      R"({"a":[1,2]])",
+      "",
+      "   ",
+  });
+}
+
+TEST_F(BodyProcessorTest, FormMatchesBuiltin) {
+  expectSameArguments("application/x-www-form-urlencoded", {
+      "a=b",
+      "a=b&c=d&e=f",
+      "a=b+c&d=%41%42%43&e=%e2%82%ac",
+      "a=%zz&b=%4&c=%",
+      "a&b=&=c&=",
+      "a=b=c&d==e",
+      "&&a=b&&",
+      "a=b&",
+      "a=%2",
+      "a=1&a=2&a=3",
+      "k%20ey=v%26alue",
+      "",
+  });
+}
+
+TEST_F(BodyProcessorTest, OtherBodiesUseBuiltin) {
+  auto xml = startTransaction("text/xml");
+  EXPECT_EQ(nullptr, BodyArgumentsProcessor::create(*xml));
+  auto multipart = startTransaction("multipart/form-data; boundary=x");
+  EXPECT_EQ(nullptr, BodyArgumentsProcessor::create(*multipart));
+  auto text = startTransaction("text/plain");
+  EXPECT_EQ(nullptr, BodyArgumentsProcessor::create(*text));
+}
+
+TEST_F(BodyProcessorTest, BodyAccessOff) {
+  // The default, as with the shipped conf/modsecurity.conf
+  auto rules = loadRules(R"(
+SecRuleEngine On
+SecRule REQUEST_HEADERS:Content-Type "application/json" "id:200001,phase:1,t:none,t:lowercase,pass,nolog,ctl:requestBodyProcessor=JSON"
+)");
+  auto json = startTransaction("application/json", rules.get());
+  EXPECT_EQ(nullptr, BodyArgumentsProcessor::create(*json));
+  auto form = startTransaction("application/x-www-form-urlencoded", rules.get());
+  EXPECT_EQ(nullptr, BodyArgumentsProcessor::create(*form));
+}
+
+TEST_F(BodyProcessorTest, BodyAccessOffByCtl) {
+  auto rules = loadRules(R"(
+SecRuleEngine On
+SecRequestBodyAccess On
+SecRule REQUEST_URI "@beginsWith /upload" "id:200010,phase:1,pass,nolog,ctl:requestBodyAccess=Off"
+)");
+  std::unique_ptr<modsecurity::Transaction> transaction(
+      new modsecurity::Transaction(modsec_.get(), rules.get(), nullptr));
+  transaction->processConnection("127.0.0.1", 12345, "127.0.0.1", 80);
+  transaction->processURI("/upload", "POST", "1.1");
+  transaction->addRequestHeader("Content-Type", "application/x-www-form-urlencoded");
+  transaction->processRequestHeaders();
+  EXPECT_EQ(nullptr, BodyArgumentsProcessor::create(*transaction));
+
+  // Other requests still go through the processor
+  auto other = startTransaction("application/x-www-form-urlencoded", rules.get());
+  EXPECT_NE(nullptr, BodyArgumentsProcessor::create(*other));
+}
+
+TEST_F(BodyProcessorTest, BodyAccessOnByCtl) {
+  auto rules = loadRules(R"(
+SecRuleEngine On
+SecRequestBodyAccess Off
+SecRule REQUEST_HEADERS:Content-Type "application/x-www-form-urlencoded" "id:200011,phase:1,pass,nolog,ctl:requestBodyAccess=On"
+)");
+  auto form = startTransaction("application/x-www-form-urlencoded", rules.get());
+  EXPECT_NE(nullptr, BodyArgumentsProcessor::create(*form));
+}
+
+TEST_F(BodyProcessorTest, RuleEngineOff) {
+  auto rules = loadRules(R"(
+SecRuleEngine Off
+SecRequestBodyAccess On
+)");
+  auto form = startTransaction("application/x-www-form-urlencoded", rules.get());
+  EXPECT_EQ(nullptr, BodyArgumentsProcessor::create(*form));
+}
+
+} // namespace
+} // namespace Http
+} // namespace Envoy
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <iostream>
@@ -6,25 +7,29 @@
 #include "utility.h"
 
 #include "absl/container/fixed_array.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "common/common/cleanup.h"
 #include "common/http/utility.h"
 #include "common/http/headers.h"
 #include "common/config/metadata.h"
+#include "envoy/common/exception.h"
 #include "envoy/server/filter_config.h"
 #include "common/json/json_loader.h"
+#include "common/tracing/http_tracer_impl.h"
 #include "modsecurity/rule_message.h"
 #include "modsecurity/audit_log.h"
+#include "modsecurity/collection/collection.h"
 
 namespace Envoy {
 namespace Http {
 
 HttpModSecurityFilterConfig::HttpModSecurityFilterConfig(const envoy::config::filter::http::modsec::v2::Decoder& proto_config,
                                                          Server::Configuration::FactoryContext& context)
-    : decoder_(proto_config) {
+    : engine_blocking_(false), random_(context.random()), decoder_(proto_config), tls_(context.threadLocal().allocateSlot()) {
 
-    modsec_.reset(new modsecurity::ModSecurity());
-    modsec_->setConnectorInformation("ModSecurity-test v0.0.1-alpha (ModSecurity test)");
-    modsec_->setServerLogCb(HttpModSecurityFilter::_logCb, modsecurity::RuleMessageLogProperty |
-                                                           modsecurity::IncludeFullHighlightLogProperty);
+    modsec_ = newModSecurity();
 
     modsec_rules_.reset(new modsecurity::Rules());
     
@@ -76,16 +81,65 @@ HttpModSecurityFilterConfig::HttpModSecurityFilterConfig(const envoy::config::fi
             };
         }
     }
-    
+
+    if (decoder().has_audit_log()) {
+        audit_ = std::make_unique<AuditSink>(decoder().audit_log(), context.api(), context.scope());
+    }
+
+    if (decoder().has_shadow_rules()) {
+        shadow_ = std::make_unique<ShadowEvaluator>(decoder().shadow_rules(), audit_.get(), context.api(),
+                                                    context.scope());
+    }
+
+    if (decoder().has_inspection_engine()) {
+        if (decoder().headers_only() || decoder().disable_response()) {
+            throw EnvoyException("ModSecurity inspection_engine doesn't support headers_only and disable_response");
+        }
+        engine_ = std::make_unique<InspectionSupervisor>(decoder().inspection_engine(), decoder(), context.api(),
+                                                         context.threadLocal(), context.scope());
+        // Engines load the same rules, if these can't block there is no verdict worth holding the stream for
+        const auto rule_engine = modsec_rules_->m_secRuleEngine;
+        engine_blocking_ = !decoder().detection_only() && rule_engine != modsecurity::Rules::DisabledRuleEngine &&
+                           rule_engine != modsecurity::Rules::DetectionOnlyRuleEngine;
+        if (!engine_blocking_) {
+            ENVOY_LOG(info, "ModSecurity rules can't block, streams flow while the inspection engine inspects them");
+        }
+    }
+
+    const bool per_worker_modsecurity = decoder().per_worker_modsecurity();
+    tls_->set([this, per_worker_modsecurity](Event::Dispatcher& dispatcher) -> ThreadLocal::ThreadLocalObjectSharedPtr {
+        return std::make_shared<WorkerContext>(per_worker_modsecurity ? newModSecurity() : modsec_,
+                                               random_.random(), dispatcher.timeSource());
+    });
+}
+
+std::shared_ptr<modsecurity::ModSecurity> HttpModSecurityFilterConfig::newModSecurity() {
+    auto modsec = std::make_shared<modsecurity::ModSecurity>();
+    modsec->setConnectorInformation("ModSecurity-test v0.0.1-alpha (ModSecurity test)");
+    modsec->setServerLogCb(HttpModSecurityFilter::_logCb, modsecurity::RuleMessageLogProperty |
+                                                          modsecurity::IncludeFullHighlightLogProperty);
+    return modsec;
 }
 
 HttpModSecurityFilterConfig::~HttpModSecurityFilterConfig() {
 }
 
 HttpModSecurityFilter::HttpModSecurityFilter(HttpModSecurityFilterConfigSharedPtr config)
-    : config_(config), intervined_(false), request_processed_(false), response_processed_(false), logged_(false), no_audit_log_(false) {
-    
-    modsec_transaction_.reset(new modsecurity::Transaction(config_->modsec_.get(), config_->modsec_rules_.get(), this));
+    : config_(config), request_headers_(nullptr), response_headers_(nullptr), decoding_data_(nullptr),
+      encoding_data_(nullptr), request_phase_(Phase::Headers), response_phase_(Phase::Headers), logged_(false), no_audit_log_(false),
+      phases_time_(0), phases_run_(0), phases_published_(0),
+      inspection_(nullptr), inspection_stream_id_(0), request_verdicts_pending_(0), response_verdicts_pending_(0),
+      inspection_started_(false), inspection_failed_(false), decoding_stopped_(false), encoding_stopped_(false) {
+
+    if (config_->engine_) {
+        // Falls back to in-process inspection if no channel is left for this worker
+        inspection_ = config_->engine_->client();
+    }
+    if (inspection_) {
+        inspection_stream_id_ = inspection_->registerStream(*this);
+    } else {
+        modsec_transaction_.reset(config_->worker().newTransaction(*config_->modsec_rules_, this));
+    }
 }
 
 HttpModSecurityFilter::~HttpModSecurityFilter() {
@@ -93,7 +147,25 @@ HttpModSecurityFilter::~HttpModSecurityFilter() {
 
 
 void HttpModSecurityFilter::onDestroy() {
+    // Request never completed, nothing to compare against
+    shadow_request_.reset();
+    if (inspection_) {
+        if (inspection_timer_) {
+            inspection_timer_->disableTimer();
+        }
+        if (inspection_started_) {
+            // Retried by the worker's next flush if the ring is full
+            if (!inspection_->closeStream(inspection_stream_id_)) {
+                config_->engine_->stats().engine_ring_full_.inc();
+            }
+            inspection_->flush();
+        }
+        inspection_->unregisterStream(inspection_stream_id_);
+        return;
+    }
     modsec_transaction_->processLogging();
+    // The stream was reset before the summary was published, or between the request and the response verdicts
+    publishSummary();
 }
 
 const char* getProtocolString(const Protocol protocol) {
@@ -110,30 +182,54 @@ const char* getProtocolString(const Protocol protocol) {
   NOT_REACHED_GCOVR_EXCL_LINE;
 }
 
-FilterHeadersStatus HttpModSecurityFilter::decodeHeaders(RequestHeaderMap& headers, bool end_stream) {
-    ENVOY_LOG(debug, "HttpModSecurityFilter::decodeHeaders");
-    if (decoder_callbacks_->route() == nullptr) {
-        return Http::FilterHeadersStatus::Continue;
-    }
-    if (intervined_ || request_processed_) {
-        ENVOY_LOG(debug, "Processed");
-        return getRequestHeadersStatus();
-    }
-    // TODO - do we want to support dynamicMetadata?
+class HttpModSecurityFilter::PhaseScope {
+public:
+    PhaseScope(HttpModSecurityFilter& filter, int phase)
+        : filter_(filter), phase_(phase),
+          system_start_(filter.decoder_callbacks_->dispatcher().timeSource().systemTime()),
+          start_(filter.decoder_callbacks_->dispatcher().timeSource().monotonicTime()) {}
+    ~PhaseScope() { filter_.endPhase(phase_, system_start_, start_); }
+
+private:
+    HttpModSecurityFilter& filter_;
+    const int phase_;
+    const SystemTime system_start_;
+    const MonotonicTime start_;
+};
+
+bool HttpModSecurityFilter::requestDisabled() {
     const auto& metadata = decoder_callbacks_->route()->routeEntry()->metadata();
     const auto& disable = Envoy::Config::Metadata::metadataValue(&metadata, ModSecurityMetadataFilter::get().ModSecurity, MetadataModSecurityKey::get().Disable);
-    ENVOY_LOG(debug, "titi3");
     const auto& disable_request = Envoy::Config::Metadata::metadataValue(&metadata, ModSecurityMetadataFilter::get().ModSecurity, MetadataModSecurityKey::get().DisableRequest);
     const auto& no_audit_log = Envoy::Config::Metadata::metadataValue(&metadata, ModSecurityMetadataFilter::get().ModSecurity, MetadataModSecurityKey::get().NoAuditLog);
      
     if (disable_request.bool_value() || disable.bool_value()) {
         ENVOY_LOG(debug, "Filter disabled");
-        request_processed_ = true;
-        return FilterHeadersStatus::Continue;
+        return true;
     }
     if (no_audit_log.bool_value()) {
         no_audit_log_ = true;
     }
+    return false;
+}
+
+bool HttpModSecurityFilter::responseDisabled() {
+    const auto& metadata = encoder_callbacks_->route()->routeEntry()->metadata();
+    const auto& disable = Envoy::Config::Metadata::metadataValue(&metadata, ModSecurityMetadataFilter::get().ModSecurity, MetadataModSecurityKey::get().Disable);
+    const auto& disable_response = Envoy::Config::Metadata::metadataValue(&metadata, ModSecurityMetadataFilter::get().ModSecurity, MetadataModSecurityKey::get().DisableResponse);
+    if (disable.bool_value() || disable_response.bool_value()) {
+        ENVOY_LOG(debug, "Filter disabled");
+        return true;
+    }
+    return false;
+}
+
+template <bool Blocking>
+bool HttpModSecurityFilter::processRequestHeaders(RequestHeaderMap& headers) {
+    if (config_->shadow_ && config_->shadow_->sample(config_->random_)) {
+        shadow_request_ = std::make_unique<ShadowRequest>();
+    }
+    request_headers_ = &headers;
     auto downstreamAddress = decoder_callbacks_->streamInfo().downstreamLocalAddress();
     // TODO - Upstream is (always?) still not resolved in this stage. Use our local proxy's ip. Is this what we want?
     ASSERT(decoder_callbacks_->connection() != nullptr);
@@ -143,78 +239,208 @@ FilterHeadersStatus HttpModSecurityFilter::decodeHeaders(RequestHeaderMap& heade
     ASSERT(downstreamAddress->type() == Network::Address::Type::Ip);
     ASSERT(localAddress != nullptr);
     ASSERT(localAddress->type() == Network::Address::Type::Ip);
-    modsec_transaction_->processConnection(downstreamAddress->ip()->addressAsString().c_str(), 
-                                          downstreamAddress->ip()->port(),
-                                          localAddress->ip()->addressAsString().c_str(), 
-                                          localAddress->ip()->port());
-    if (interventionLog()) {
-        return FilterHeadersStatus::StopIteration;
+    {
+        // Connection and uri have no rules of their own, they are accounted to phase 1
+        PhaseScope phase(*this, 1);
+        modsec_transaction_->processConnection(downstreamAddress->ip()->addressAsString().c_str(), 
+                                              downstreamAddress->ip()->port(),
+                                              localAddress->ip()->addressAsString().c_str(), 
+                                              localAddress->ip()->port());
+        if (shadow_request_) {
+            shadow_request_->client_ip = downstreamAddress->ip()->addressAsString();
+            shadow_request_->client_port = downstreamAddress->ip()->port();
+            shadow_request_->server_ip = localAddress->ip()->addressAsString();
+            shadow_request_->server_port = localAddress->ip()->port();
+            shadow_request_->uri = std::string(headers.Path()->value().getStringView());
+            shadow_request_->method = std::string(headers.Method()->value().getStringView());
+            shadow_request_->protocol = getProtocolString(decoder_callbacks_->streamInfo().protocol().value_or(Protocol::Http11));
+            headers.iterate(
+                    [this](const Http::HeaderEntry& header) -> HeaderMap::Iterate {
+                        shadow_request_->headers.emplace_back(std::string(header.key().getStringView()),
+                                                              std::string(header.value().getStringView()));
+                        return HeaderMap::Iterate::Continue;
+                    });
+        }
+        // As in the other phases, the scope is closed before intervening. A blocking filter stops at the first
+        // disruptive step, the intervention is then sent below
+        if (!(Blocking && modsec_transaction_->m_it.disruptive)) {
+            auto uri = headers.Path();
+            auto method = headers.Method();
+            modsec_transaction_->processURI(std::string(uri->value().getStringView()).c_str(), 
+                                            std::string(method->value().getStringView()).c_str(),
+                                            getProtocolString(decoder_callbacks_->streamInfo().protocol().value_or(Protocol::Http11)));
+        }
+        if (!(Blocking && modsec_transaction_->m_it.disruptive)) {
+            headers.iterate(
+                    [this](const Http::HeaderEntry& header) -> HeaderMap::Iterate {
+                        
+                        std::string k = std::string(header.key().getStringView());
+                        std::string v = std::string(header.value().getStringView());
+                        modsec_transaction_->addRequestHeader(k.c_str(), v.c_str());
+                        // TODO - does this special case makes sense? it doesn't exist on apache/nginx modsecurity bridges.
+                        // host header is cannonized to :authority even on http older than 2 
+                        // see https://github.com/envoyproxy/envoy/issues/2209
+                        if (k == Headers::get().Host.get()) {
+                            modsec_transaction_->addRequestHeader(Headers::get().HostLegacy.get().c_str(), v.c_str());
+                        }
+                        return HeaderMap::Iterate::Continue;
+                    });
+            modsec_transaction_->processRequestHeaders();
+        }
     }
-    auto uri = headers.Path();
-    auto method = headers.Method();
-    modsec_transaction_->processURI(std::string(uri->value().getStringView()).c_str(), 
-                                    std::string(method->value().getStringView()).c_str(),
-                                    getProtocolString(decoder_callbacks_->streamInfo().protocol().value_or(Protocol::Http11)));
-    if (interventionLog()) {
-        return FilterHeadersStatus::StopIteration;
+    return interventionLog<Blocking>();
+}
+
+template <bool Blocking>
+bool HttpModSecurityFilter::processRequestBody() {
+    {
+        PhaseScope phase(*this, 2);
+        if (body_processor_) {
+            body_processor_->finish();
+        }
+        modsec_transaction_->processRequestBody();
     }
-    headers.iterate(
-            [this](const Http::HeaderEntry& header) -> HeaderMap::Iterate {
-                
-                std::string k = std::string(header.key().getStringView());
-                std::string v = std::string(header.value().getStringView());
-                modsec_transaction_->addRequestHeader(k.c_str(), v.c_str());
-                // TODO - does this special case makes sense? it doesn't exist on apache/nginx modsecurity bridges.
-                // host header is cannonized to :authority even on http older than 2 
-                // see https://github.com/envoyproxy/envoy/issues/2209
-                if (k == Headers::get().Host.get()) {
-                    modsec_transaction_->addRequestHeader(Headers::get().HostLegacy.get().c_str(), v.c_str());
-                }
-                return HeaderMap::Iterate::Continue;
-            });
-    modsec_transaction_->processRequestHeaders();
-    if (end_stream) {
-        request_processed_ = true;
+    return interventionLog<Blocking>();
+}
+
+template <bool Blocking>
+bool HttpModSecurityFilter::processResponseHeaders(ResponseHeaderMap& headers) {
+    {
+        PhaseScope phase(*this, 3);
+        response_headers_ = &headers;
+        uint64_t code = Utility::getResponseStatus(headers);
+        headers.iterate(
+                [this](const Http::HeaderEntry& header) -> HeaderMap::Iterate {
+                    modsec_transaction_->addResponseHeader(
+                        std::string(header.key().getStringView()).c_str(),
+                        std::string(header.value().getStringView()).c_str()
+                    );
+                    return HeaderMap::Iterate::Continue;
+                });
+        modsec_transaction_->processResponseHeaders(code, 
+                getProtocolString(encoder_callbacks_->streamInfo().protocol().value_or(Protocol::Http11)));
+    }
+    return interventionLog<Blocking>();
+}
+
+template <bool Blocking>
+bool HttpModSecurityFilter::processResponseBody() {
+    {
+        PhaseScope phase(*this, 4);
+        modsec_transaction_->processResponseBody();
+    }
+    return interventionLog<Blocking>();
+}
+
+template <bool Blocking, bool InspectBodies, bool InspectResponse>
+FilterHeadersStatus HttpModSecurityFilterImpl<Blocking, InspectBodies, InspectResponse>::decodeHeaders(RequestHeaderMap& headers, bool end_stream) {
+    ENVOY_LOG(debug, "HttpModSecurityFilter::decodeHeaders");
+    if (decoder_callbacks_->route() == nullptr) {
+        return Http::FilterHeadersStatus::Continue;
+    }
+    if (request_phase_ != Phase::Headers) {
+        ENVOY_LOG(debug, "Processed");
+        return getRequestHeadersStatus();
     }
-    if (interventionLog()) {
+    if (requestDisabled()) {
+        request_phase_ = Phase::Done;
+        return FilterHeadersStatus::Continue;
+    }
+    if (Engine && inspection_) {
+        return inspectRequestHeaders(headers, end_stream);
+    }
+    if (processRequestHeaders<Blocking>(headers)) {
         return FilterHeadersStatus::StopIteration;
     }
+    if (!InspectBodies) {
+        // Phase 2 rules still run, on everything but the body
+        request_phase_ = Phase::Done;
+        if (processRequestBody<Blocking>()) {
+            return FilterHeadersStatus::StopIteration;
+        }
+    } else if (end_stream) {
+        request_phase_ = Phase::Done;
+    } else {
+        request_phase_ = Phase::Body;
+        if (config_->decoder().fast_body_arguments()) {
+            body_processor_ = BodyArgumentsProcessor::create(*modsec_transaction_);
+        }
+    }
+    if (request_phase_ == Phase::Done) {
+        publishSummary();
+    }
+    submitShadow();
     return getRequestHeadersStatus();
 }
 
-FilterDataStatus HttpModSecurityFilter::decodeData(Buffer::Instance& data, bool end_stream) {
+template <bool Blocking, bool InspectBodies, bool InspectResponse>
+FilterDataStatus HttpModSecurityFilterImpl<Blocking, InspectBodies, InspectResponse>::decodeData(Buffer::Instance& data, bool end_stream) {
     ENVOY_LOG(debug, "HttpModSecurityFilter::decodeData");
-    if (intervined_ || request_processed_) {
-        ENVOY_LOG(debug, "Processed");
+    if (!InspectBodies || request_phase_ != Phase::Body) {
         return getRequestStatus();
     }
+    if (Engine && inspection_) {
+        return inspectRequestBody(data, end_stream);
+    }
+    decoding_data_ = &data;
+    Cleanup reset_data([this]() { decoding_data_ = nullptr; });
     for (const Buffer::RawSlice& slice : data.getRawSlices()) {
+        if (shadow_request_ && !shadow_request_->body_truncated) {
+            if (shadow_request_->body.size() + slice.len_ > config_->shadow_->maxBodyBytes()) {
+                // The primary rules see the whole body, the copy is released and the request skipped
+                shadow_request_->body_truncated = true;
+                std::string().swap(shadow_request_->body);
+            } else {
+                shadow_request_->body.append(static_cast<const char*>(slice.mem_), slice.len_);
+            }
+        }
         size_t requestLen = modsec_transaction_->getRequestBodyLength();
         // If append fails or append reached the limit, test for intervention (in case SecRequestBodyLimitAction is set to Reject)
         // Note, we can't rely solely on the return value of append, when SecRequestBodyLimitAction is set to Reject it returns true and sets the intervention
         if (modsec_transaction_->appendRequestBody(static_cast<unsigned char*>(slice.mem_), slice.len_) == false ||
             (slice.len_ > 0 && requestLen == modsec_transaction_->getRequestBodyLength())) {
             ENVOY_LOG(debug, "HttpModSecurityFilter::decodeData appendRequestBody reached limit");
-            if (interventionLog()) {
+            if (interventionLog<Blocking>()) {
                 return FilterDataStatus::StopIterationNoBuffer;
             }
             // Otherwise set to process request
             end_stream = true;
+            if (body_processor_) {
+                body_processor_->append(static_cast<const char*>(slice.mem_),
+                                        modsec_transaction_->getRequestBodyLength() - requestLen);
+            }
             break;
         }
+        if (body_processor_) {
+            body_processor_->append(static_cast<const char*>(slice.mem_), slice.len_);
+        }
     }
 
     if (end_stream) {
-        request_processed_ = true;
-        modsec_transaction_->processRequestBody();
+        request_phase_ = Phase::Done;
+        if (processRequestBody<Blocking>()) {
+            return FilterDataStatus::StopIterationNoBuffer;
+        }
+        publishSummary();
     }
-    if (interventionLog()) {
-        return FilterDataStatus::StopIterationNoBuffer;
-    } 
+    submitShadow();
     return getRequestStatus();
 }
 
 FilterTrailersStatus HttpModSecurityFilter::decodeTrailers(RequestTrailerMap&) {
+    if (inspection_ && inspection_started_ && !inspection_failed_ && request_phase_ == Phase::Body) {
+        // The body ends with the trailers
+        request_phase_ = Phase::Done;
+        if (!inspection_->send(inspection_stream_id_, InspectionMessage::RequestBodyDone, nullptr, 0)) {
+            config_->engine_->stats().engine_ring_full_.inc();
+            return inspectionUnavailable() ? FilterTrailersStatus::StopIteration : FilterTrailersStatus::Continue;
+        }
+        inspection_->flush();
+        request_verdicts_pending_++;
+        armInspectionTimer();
+        decoding_stopped_ = true;
+        return FilterTrailersStatus::StopIteration;
+    }
   return FilterTrailersStatus::Continue;
 }
 
@@ -223,46 +449,41 @@ void HttpModSecurityFilter::setDecoderFilterCallbacks(StreamDecoderFilterCallbac
 }
 
 
-FilterHeadersStatus HttpModSecurityFilter::encodeHeaders(ResponseHeaderMap& headers, bool end_stream) {
+template <bool Blocking, bool InspectBodies, bool InspectResponse>
+FilterHeadersStatus HttpModSecurityFilterImpl<Blocking, InspectBodies, InspectResponse>::encodeHeaders(ResponseHeaderMap& headers, bool end_stream) {
     ENVOY_LOG(debug, "HttpModSecurityFilter::encodeHeaders");
-    if (decoder_callbacks_->route() == nullptr) {
+    if (!InspectResponse || decoder_callbacks_->route() == nullptr) {
         return Http::FilterHeadersStatus::Continue;
     }
-    if (intervined_ || response_processed_) {
+    if (response_phase_ != Phase::Headers) {
         ENVOY_LOG(debug, "Processed");
         return getResponseHeadersStatus();
     }
-    // TODO - do we want to support dynamicMetadata?
-    const auto& metadata = encoder_callbacks_->route()->routeEntry()->metadata();
-    const auto& disable = Envoy::Config::Metadata::metadataValue(&metadata, ModSecurityMetadataFilter::get().ModSecurity, MetadataModSecurityKey::get().Disable);
-    const auto& disable_response = Envoy::Config::Metadata::metadataValue(&metadata, ModSecurityMetadataFilter::get().ModSecurity, MetadataModSecurityKey::get().DisableResponse);
-    if (disable.bool_value() || disable_response.bool_value()) {
-        ENVOY_LOG(debug, "Filter disabled");
-        response_processed_ = true;
+    if (responseDisabled()) {
+        response_phase_ = Phase::Done;
         return FilterHeadersStatus::Continue;
     }
-
-    auto status = headers.Status();
-    uint64_t code = Utility::getResponseStatus(headers);
-    headers.iterate(
-            [this](const Http::HeaderEntry& header) -> HeaderMap::Iterate {
-                modsec_transaction_->addResponseHeader(
-                    std::string(header.key().getStringView()).c_str(),
-                    std::string(header.value().getStringView()).c_str()
-                );
-                return HeaderMap::Iterate::Continue;
-            });
-    modsec_transaction_->processResponseHeaders(code, 
-            getProtocolString(encoder_callbacks_->streamInfo().protocol().value_or(Protocol::Http11)));
-        
-    if (end_stream) {
-        ENVOY_LOG(debug, "HttpModSecurityFilter::encodeHeaders -> end stream");
-        response_processed_ = true;
+    if (Engine && inspection_) {
+        return inspectResponseHeaders(headers, end_stream);
     }
-    
-    if (interventionLog()) {
+    if (processResponseHeaders<Blocking>(headers)) {
         return FilterHeadersStatus::StopIteration;
     }
+    if (!InspectBodies) {
+        // Phase 4 rules still run, on everything but the body
+        response_phase_ = Phase::Done;
+        if (processResponseBody<Blocking>()) {
+            return FilterHeadersStatus::StopIteration;
+        }
+    } else if (end_stream) {
+        ENVOY_LOG(debug, "HttpModSecurityFilter::encodeHeaders -> end stream");
+        response_phase_ = Phase::Done;
+    } else {
+        response_phase_ = Phase::Body;
+    }
+    if (response_phase_ == Phase::Done) {
+        publishSummary();
+    }
     return getResponseHeadersStatus();
 }
 
@@ -270,13 +491,18 @@ FilterHeadersStatus HttpModSecurityFilter::encode100ContinueHeaders(ResponseHead
     return FilterHeadersStatus::Continue;
 }
 
-FilterDataStatus HttpModSecurityFilter::encodeData(Buffer::Instance& data, bool end_stream) {
+template <bool Blocking, bool InspectBodies, bool InspectResponse>
+FilterDataStatus HttpModSecurityFilterImpl<Blocking, InspectBodies, InspectResponse>::encodeData(Buffer::Instance& data, bool end_stream) {
     ENVOY_LOG(debug, "HttpModSecurityFilter::encodeData");
-    if (intervined_ || response_processed_) {
-        ENVOY_LOG(debug, "Processed");
-        return getResponseStatus();
+    // If intervined, let the local reply flow
+    if (!InspectResponse || !InspectBodies || response_phase_ != Phase::Body) {
+        return FilterDataStatus::Continue;
     }
-    
+    if (Engine && inspection_) {
+        return inspectResponseBody(data, end_stream);
+    }
+    encoding_data_ = &data;
+    Cleanup reset_data([this]() { encoding_data_ = nullptr; });
     for (const Buffer::RawSlice& slice : data.getRawSlices()) {
         size_t responseLen = modsec_transaction_->getResponseBodyLength();
         // If append fails or append reached the limit, test for intervention (in case SecResponseBodyLimitAction is set to Reject)
@@ -284,7 +510,7 @@ FilterDataStatus HttpModSecurityFilter::encodeData(Buffer::Instance& data, bool
         if (modsec_transaction_->appendResponseBody(static_cast<unsigned char*>(slice.mem_), slice.len_) == false ||
             (slice.len_ > 0 && responseLen == modsec_transaction_->getResponseBodyLength())) {
             ENVOY_LOG(debug, "HttpModSecurityFilter::encodeData appendResponseBody reached limit");
-            if (interventionLog()) {
+            if (interventionLog<Blocking>()) {
                 return FilterDataStatus::StopIterationNoBuffer;
             }
             // Otherwise set to process response
@@ -294,16 +520,29 @@ FilterDataStatus HttpModSecurityFilter::encodeData(Buffer::Instance& data, bool
     }
 
     if (end_stream) {
-        response_processed_ = true;
-        modsec_transaction_->processResponseBody();
-    }
-    if (interventionLog()) {
-        return FilterDataStatus::StopIterationNoBuffer;
+        response_phase_ = Phase::Done;
+        if (processResponseBody<Blocking>()) {
+            return FilterDataStatus::StopIterationNoBuffer;
+        }
+        publishSummary();
     }
     return getResponseStatus();
 }
 
 FilterTrailersStatus HttpModSecurityFilter::encodeTrailers(ResponseTrailerMap&) {
+    if (inspection_ && inspection_started_ && !inspection_failed_ && response_phase_ == Phase::Body) {
+        // The body ends with the trailers
+        response_phase_ = Phase::Done;
+        if (!inspection_->send(inspection_stream_id_, InspectionMessage::ResponseBodyDone, nullptr, 0)) {
+            config_->engine_->stats().engine_ring_full_.inc();
+            return inspectionUnavailable() ? FilterTrailersStatus::StopIteration : FilterTrailersStatus::Continue;
+        }
+        inspection_->flush();
+        response_verdicts_pending_++;
+        armInspectionTimer();
+        encoding_stopped_ = true;
+        return FilterTrailersStatus::StopIteration;
+    }
     return FilterTrailersStatus::Continue;
 }
 
@@ -316,104 +555,419 @@ void HttpModSecurityFilter::setEncoderFilterCallbacks(StreamEncoderFilterCallbac
     encoder_callbacks_ = &callbacks;
 }
 
+template <bool Blocking>
 bool HttpModSecurityFilter::interventionLog() {
-    if (intervined_ || (modsec_transaction_->m_it.status == 200 && !modsec_transaction_->m_it.disruptive)) {
-        return intervined_;
+    if (request_phase_ == Phase::Intervened ||
+        (modsec_transaction_->m_it.status == 200 && !modsec_transaction_->m_it.disruptive)) {
+        return request_phase_ == Phase::Intervened;
     }
     if (!logged_ && !no_audit_log_) {
         logged_ = true;
         int parts = modsec_transaction_->m_rules->m_auditLog->getParts();
-        if (modsec_transaction_->m_rules->m_auditLog->m_format == modsecurity::audit_log::AuditLog::JSONAuditLogFormat) {
+        if (config_->audit_) {
+            writeAuditRecord();
+        } else if (modsec_transaction_->m_rules->m_auditLog->m_format == modsecurity::audit_log::AuditLog::JSONAuditLogFormat) {
             ENVOY_LOG(warn, "{}", modsec_transaction_->toJSON(parts));
         } else {
-            std::string boundary;
-            generateBoundary(&boundary);
-            ENVOY_LOG(warn, "{}", modsec_transaction_->toOldAuditLogFormat(parts, "-" + boundary + "--"));
+            ENVOY_LOG(warn, "{}", modsec_transaction_->toOldAuditLogFormat(parts, config_->worker().auditLogBoundary()));
         }
         
     }
-    if (modsec_transaction_->m_it.disruptive) {
-        intervined_ = true;
+    if (Blocking && modsec_transaction_->m_it.disruptive) {
         ENVOY_LOG(debug, "intervention");
-        decoder_callbacks_->sendLocalReply(static_cast<Http::Code>(modsec_transaction_->m_it.status), 
-                                           "empty\n",
-                                           [](Http::HeaderMap& headers) {
-                                           }, absl::nullopt, "");
+        intervene(static_cast<Http::Code>(modsec_transaction_->m_it.status));
     }
-    return intervined_;
+    return request_phase_ == Phase::Intervened;
 }
 
+void HttpModSecurityFilter::writeAuditRecord() {
+    using modsecurity::audit_log::AuditLog;
+    AuditLog& audit_log = *modsec_transaction_->m_rules->m_auditLog;
+    const int parts = audit_log.getParts();
+    const bool json = audit_log.m_format == AuditLog::JSONAuditLogFormat;
+    // ModSecurity would copy both bodies into the record, these parts are written from envoy's maps and buffers
+    const int modsec_parts = parts & ~(AuditLog::BAuditLogPart | AuditLog::CAuditLogPart |
+                                       AuditLog::EAuditLogPart | AuditLog::FAuditLogPart);
+    const std::string trailer = json ? "" : config_->worker().auditLogBoundary();
+    AuditRecord record(*config_->audit_, json,
+                       json ? modsec_transaction_->toJSON(modsec_parts)
+                            : modsec_transaction_->toOldAuditLogFormat(modsec_parts, trailer),
+                       trailer);
+    if (parts & AuditLog::BAuditLogPart) {
+        record.addHeaders(true, request_headers_);
+    }
+    if (parts & AuditLog::CAuditLogPart) {
+        record.addBody(true, decoder_callbacks_->decodingBuffer(), decoding_data_);
+    }
+    if (parts & AuditLog::FAuditLogPart) {
+        record.addHeaders(false, response_headers_);
+    }
+    if (parts & AuditLog::EAuditLogPart) {
+        record.addBody(false, encoder_callbacks_->encodingBuffer(), encoding_data_);
+    }
+    record.commit();
+}
 
-FilterHeadersStatus HttpModSecurityFilter::getRequestHeadersStatus() {
-    if (intervined_) {
-        ENVOY_LOG(debug, "StopIteration");
-        return FilterHeadersStatus::StopIteration;
+void HttpModSecurityFilter::intervene(Http::Code code) {
+    request_phase_ = Phase::Intervened;
+    response_phase_ = Phase::Intervened;
+    submitShadow();
+    // Before the local reply, which runs the encoder filters and may end the stream
+    publishSummary();
+    decoder_callbacks_->sendLocalReply(code, 
+                                       "empty\n",
+                                       [](Http::HeaderMap& headers) {
+                                       }, absl::nullopt, "");
+}
+
+void HttpModSecurityFilter::submitShadow() {
+    if (!shadow_request_ || request_phase_ < Phase::Done) {
+        return;
+    }
+    // Set whether or not the filter acted on it (detection_only)
+    shadow_request_->primary_disruptive = modsec_transaction_->m_it.disruptive;
+    shadow_request_->primary_status = modsec_transaction_->m_it.status;
+    config_->shadow_->submit(std::move(shadow_request_));
+}
+
+template <bool Blocking, bool InspectBodies, bool InspectResponse>
+FilterHeadersStatus HttpModSecurityFilterImpl<Blocking, InspectBodies, InspectResponse>::getRequestHeadersStatus() {
+    if (!Blocking) {
+        return FilterHeadersStatus::Continue;
     }
-    if (request_processed_) {
-        ENVOY_LOG(debug, "Continue");
+    switch (request_phase_) {
+    case Phase::Intervened:
+        return FilterHeadersStatus::StopIteration;
+    case Phase::Body:
+        // If disruptive, hold until the request is processed, otherwise let the data flow.
+        return holdUntilProcessed() ? FilterHeadersStatus::StopIteration : FilterHeadersStatus::Continue;
+    default:
         return FilterHeadersStatus::Continue;
     }
-    // If disruptive, hold until request_processed_, otherwise let the data flow.
-    ENVOY_LOG(debug, "RuleEngine");
-    return modsec_transaction_->getRuleEngineState() == modsecurity::Rules::EnabledRuleEngine ? 
-                FilterHeadersStatus::StopIteration : 
-                FilterHeadersStatus::Continue;
 }
 
-FilterDataStatus HttpModSecurityFilter::getRequestStatus() {
-    if (intervined_) {
-        ENVOY_LOG(debug, "StopIterationNoBuffer");
+template <bool Blocking, bool InspectBodies, bool InspectResponse>
+FilterDataStatus HttpModSecurityFilterImpl<Blocking, InspectBodies, InspectResponse>::getRequestStatus() {
+    if (!Blocking) {
+        return FilterDataStatus::Continue;
+    }
+    switch (request_phase_) {
+    case Phase::Intervened:
         return FilterDataStatus::StopIterationNoBuffer;
+    case Phase::Body:
+        // If disruptive, hold until the request is processed, otherwise let the data flow.
+        return holdUntilProcessed() ? FilterDataStatus::StopIterationAndBuffer : FilterDataStatus::Continue;
+    default:
+        return FilterDataStatus::Continue;
+    }
+}
+
+template <bool Blocking, bool InspectBodies, bool InspectResponse>
+FilterHeadersStatus HttpModSecurityFilterImpl<Blocking, InspectBodies, InspectResponse>::getResponseHeadersStatus() {
+    // If intervined, let the local reply flow
+    if (!Blocking || response_phase_ != Phase::Body) {
+        return FilterHeadersStatus::Continue;
     }
-    if (request_processed_) {
-        ENVOY_LOG(debug, "Continue");
+    // If disruptive, hold until the response is processed, otherwise let the data flow.
+    return holdUntilProcessed() ? FilterHeadersStatus::StopIteration : FilterHeadersStatus::Continue;
+}
+
+template <bool Blocking, bool InspectBodies, bool InspectResponse>
+FilterDataStatus HttpModSecurityFilterImpl<Blocking, InspectBodies, InspectResponse>::getResponseStatus() {
+    // If intervined, let the local reply flow
+    if (!Blocking || response_phase_ != Phase::Body) {
         return FilterDataStatus::Continue;
     }
-    // If disruptive, hold until request_processed_, otherwise let the data flow.
-    ENVOY_LOG(debug, "RuleEngine");
-    return modsec_transaction_->getRuleEngineState() == modsecurity::Rules::EnabledRuleEngine ? 
-                FilterDataStatus::StopIterationAndBuffer : 
-                FilterDataStatus::Continue;
+    // If disruptive, hold until the response is processed, otherwise let the data flow.
+    return holdUntilProcessed() ? FilterDataStatus::StopIterationAndBuffer : FilterDataStatus::Continue;
 }
 
-FilterHeadersStatus HttpModSecurityFilter::getResponseHeadersStatus() {
-    if (intervined_ || response_processed_) {
-        // If intervined, let encodeData return the localReply
-        ENVOY_LOG(debug, "Continue");
+FilterHeadersStatus HttpModSecurityFilter::inspectRequestHeaders(RequestHeaderMap& headers, bool end_stream) {
+    auto downstreamAddress = decoder_callbacks_->streamInfo().downstreamLocalAddress();
+    ASSERT(decoder_callbacks_->connection() != nullptr);
+    auto localAddress = decoder_callbacks_->connection()->localAddress();
+    ASSERT(downstreamAddress != nullptr);
+    ASSERT(localAddress != nullptr);
+    inspection_started_ = true;
+    bool sent = inspection_->send(inspection_stream_id_, InspectionMessage::Connection, {
+                    downstreamAddress->ip()->addressAsString(), std::to_string(downstreamAddress->ip()->port()),
+                    localAddress->ip()->addressAsString(), std::to_string(localAddress->ip()->port()),
+                    no_audit_log_ ? "1" : "0"}) &&
+                inspection_->send(inspection_stream_id_, InspectionMessage::Uri, {
+                    std::string(headers.Path()->value().getStringView()),
+                    std::string(headers.Method()->value().getStringView()),
+                    getProtocolString(decoder_callbacks_->streamInfo().protocol().value_or(Protocol::Http11))});
+    headers.iterate(
+            [this, &sent](const Http::HeaderEntry& header) -> HeaderMap::Iterate {
+                std::string k = std::string(header.key().getStringView());
+                std::string v = std::string(header.value().getStringView());
+                sent = sent && inspection_->send(inspection_stream_id_, InspectionMessage::RequestHeader, {k, v});
+                // Same host special case as the in-process transaction
+                if (k == Headers::get().Host.get()) {
+                    sent = sent && inspection_->send(inspection_stream_id_, InspectionMessage::RequestHeader,
+                                                     {Headers::get().HostLegacy.get(), v});
+                }
+                return sent ? HeaderMap::Iterate::Continue : HeaderMap::Iterate::Break;
+            });
+    sent = sent && inspection_->send(inspection_stream_id_, InspectionMessage::RequestHeadersDone,
+                                     {end_stream ? "1" : "0"});
+    inspection_->flush();
+    request_phase_ = end_stream ? Phase::Done : Phase::Body;
+    if (!sent) {
+        config_->engine_->stats().engine_ring_full_.inc();
+        return inspectionUnavailable() ? FilterHeadersStatus::StopIteration : FilterHeadersStatus::Continue;
+    }
+    if (!config_->engine_blocking_) {
+        return FilterHeadersStatus::Continue;
+    }
+    request_verdicts_pending_++;
+    armInspectionTimer();
+    decoding_stopped_ = true;
+    return FilterHeadersStatus::StopIteration;
+}
+
+FilterDataStatus HttpModSecurityFilter::inspectRequestBody(Buffer::Instance& data, bool end_stream) {
+    if (!inspection_started_ || inspection_failed_) {
+        return FilterDataStatus::Continue;
+    }
+    bool sent = true;
+    for (const Buffer::RawSlice& slice : data.getRawSlices()) {
+        sent = sent && inspection_->send(inspection_stream_id_, InspectionMessage::RequestBody, slice.mem_, slice.len_);
+    }
+    if (end_stream) {
+        request_phase_ = Phase::Done;
+        sent = sent && inspection_->send(inspection_stream_id_, InspectionMessage::RequestBodyDone, nullptr, 0);
+    }
+    inspection_->flush();
+    if (!sent) {
+        config_->engine_->stats().engine_ring_full_.inc();
+        return inspectionUnavailable() ? FilterDataStatus::StopIterationNoBuffer : FilterDataStatus::Continue;
+    }
+    if (!config_->engine_blocking_) {
+        return FilterDataStatus::Continue;
+    }
+    if (end_stream) {
+        request_verdicts_pending_++;
+        armInspectionTimer();
+    }
+    decoding_stopped_ = true;
+    return FilterDataStatus::StopIterationAndBuffer;
+}
+
+FilterHeadersStatus HttpModSecurityFilter::inspectResponseHeaders(ResponseHeaderMap& headers, bool end_stream) {
+    if (!inspection_started_ || inspection_failed_) {
+        return FilterHeadersStatus::Continue;
+    }
+    bool sent = true;
+    headers.iterate(
+            [this, &sent](const Http::HeaderEntry& header) -> HeaderMap::Iterate {
+                sent = sent && inspection_->send(inspection_stream_id_, InspectionMessage::ResponseHeader, {
+                           std::string(header.key().getStringView()), std::string(header.value().getStringView())});
+                return sent ? HeaderMap::Iterate::Continue : HeaderMap::Iterate::Break;
+            });
+    sent = sent && inspection_->send(inspection_stream_id_, InspectionMessage::ResponseHeadersDone, {
+                       std::to_string(Utility::getResponseStatus(headers)),
+                       getProtocolString(encoder_callbacks_->streamInfo().protocol().value_or(Protocol::Http11)),
+                       end_stream ? "1" : "0"});
+    inspection_->flush();
+    response_phase_ = end_stream ? Phase::Done : Phase::Body;
+    if (!sent) {
+        config_->engine_->stats().engine_ring_full_.inc();
+        return inspectionUnavailable() ? FilterHeadersStatus::StopIteration : FilterHeadersStatus::Continue;
+    }
+    if (!config_->engine_blocking_) {
         return FilterHeadersStatus::Continue;
     }
-    // If disruptive, hold until response_processed_, otherwise let the data flow.
-    ENVOY_LOG(debug, "RuleEngine");
-    return modsec_transaction_->getRuleEngineState() == modsecurity::Rules::EnabledRuleEngine ? 
-                FilterHeadersStatus::StopIteration : 
-                FilterHeadersStatus::Continue;
+    response_verdicts_pending_++;
+    armInspectionTimer();
+    encoding_stopped_ = true;
+    return FilterHeadersStatus::StopIteration;
 }
 
-FilterDataStatus HttpModSecurityFilter::getResponseStatus() {
-    if (intervined_ || response_processed_) {
-        // If intervined, let encodeData return the localReply
-        ENVOY_LOG(debug, "Continue");
+FilterDataStatus HttpModSecurityFilter::inspectResponseBody(Buffer::Instance& data, bool end_stream) {
+    if (!inspection_started_ || inspection_failed_) {
+        return FilterDataStatus::Continue;
+    }
+    bool sent = true;
+    for (const Buffer::RawSlice& slice : data.getRawSlices()) {
+        sent = sent && inspection_->send(inspection_stream_id_, InspectionMessage::ResponseBody, slice.mem_, slice.len_);
+    }
+    if (end_stream) {
+        response_phase_ = Phase::Done;
+        sent = sent && inspection_->send(inspection_stream_id_, InspectionMessage::ResponseBodyDone, nullptr, 0);
+    }
+    inspection_->flush();
+    if (!sent) {
+        config_->engine_->stats().engine_ring_full_.inc();
+        return inspectionUnavailable() ? FilterDataStatus::StopIterationNoBuffer : FilterDataStatus::Continue;
+    }
+    if (!config_->engine_blocking_) {
         return FilterDataStatus::Continue;
     }
-    // If disruptive, hold until response_processed_, otherwise let the data flow.
-    ENVOY_LOG(debug, "RuleEngine");
-    return modsec_transaction_->getRuleEngineState() == modsecurity::Rules::EnabledRuleEngine ? 
-                FilterDataStatus::StopIterationAndBuffer : 
-                FilterDataStatus::Continue;
+    if (end_stream) {
+        response_verdicts_pending_++;
+        armInspectionTimer();
+    }
+    encoding_stopped_ = true;
+    return FilterDataStatus::StopIterationAndBuffer;
+}
 
+void HttpModSecurityFilter::onVerdict(InspectionMessage checkpoint, int status, bool disruptive) {
+    if (request_phase_ == Phase::Intervened || inspection_failed_) {
+        return;
+    }
+    config_->engine_->stats().engine_verdicts_.inc();
+    if (!config_->engine_blocking_) {
+        // Nothing is held, the engine already audit logged the transaction
+        return;
+    }
+    if (disruptive) {
+        inspection_timer_->disableTimer();
+        ENVOY_LOG(debug, "intervention");
+        intervene(static_cast<Http::Code>(status));
+        return;
+    }
+    switch (checkpoint) {
+    case InspectionMessage::RequestHeadersDone:
+    case InspectionMessage::RequestBodyDone:
+        request_verdicts_pending_--;
+        break;
+    case InspectionMessage::ResponseHeadersDone:
+    case InspectionMessage::ResponseBodyDone:
+        response_verdicts_pending_--;
+        break;
+    default:
+        return;
+    }
+    if (request_verdicts_pending_ == 0 && response_verdicts_pending_ == 0) {
+        inspection_timer_->disableTimer();
+    } else {
+        armInspectionTimer();
+    }
+    // Same as in-process, hold until the whole request / response got its verdict
+    if (decoding_stopped_ && request_phase_ == Phase::Done && request_verdicts_pending_ == 0) {
+        decoding_stopped_ = false;
+        decoder_callbacks_->continueDecoding();
+    }
+    if (encoding_stopped_ && response_phase_ == Phase::Done && response_verdicts_pending_ == 0) {
+        encoding_stopped_ = false;
+        encoder_callbacks_->continueEncoding();
+    }
 }
 
-void HttpModSecurityFilter::generateBoundary(std::string *boundary) {
-    static const char alphanum[] =
-        "0123456789"
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-        "abcdefghijklmnopqrstuvwxyz";
+void HttpModSecurityFilter::armInspectionTimer() {
+    if (!inspection_timer_) {
+        inspection_timer_ = decoder_callbacks_->dispatcher().createTimer([this]() -> void { onInspectionTimeout(); });
+    }
+    inspection_timer_->enableTimer(config_->engine_->timeout());
+}
 
-    for (int i = 0; i < 8; ++i) {
-        boundary->append(1, alphanum[rand() % (sizeof(alphanum) - 1)]);
+void HttpModSecurityFilter::onInspectionTimeout() {
+    ENVOY_LOG(debug, "HttpModSecurityFilter inspection engine timed out");
+    config_->engine_->stats().engine_timeouts_.inc();
+    const bool decoding_stopped = decoding_stopped_;
+    const bool encoding_stopped = encoding_stopped_;
+    if (inspectionUnavailable()) {
+        return;
+    }
+    if (decoding_stopped) {
+        decoder_callbacks_->continueDecoding();
+    }
+    if (encoding_stopped) {
+        encoder_callbacks_->continueEncoding();
     }
 }
 
+bool HttpModSecurityFilter::inspectionUnavailable() {
+    inspection_failed_ = true;
+    request_verdicts_pending_ = 0;
+    response_verdicts_pending_ = 0;
+    decoding_stopped_ = false;
+    encoding_stopped_ = false;
+    if (inspection_timer_) {
+        inspection_timer_->disableTimer();
+    }
+    if (!config_->engine_->failClosed() || !config_->engine_blocking_) {
+        // Fail open, the rest of the stream flows uninspected
+        return false;
+    }
+    intervene(Http::Code::ServiceUnavailable);
+    return true;
+}
+
+void HttpModSecurityFilter::endPhase(int phase, SystemTime system_start, MonotonicTime start) {
+    const auto duration = std::chrono::duration_cast<std::chrono::microseconds>(
+        decoder_callbacks_->dispatcher().timeSource().monotonicTime() - start);
+    phases_time_ += duration;
+    phases_run_++;
+
+    if (!traced()) {
+        return;
+    }
+    // RuleMessage phases are numbered as in the rules (phase:1 .. phase:5)
+    std::vector<std::string> rule_ids;
+    for (const auto& ruleMessage : modsec_transaction_->m_rulesMessages) {
+        if (ruleMessage.m_phase == phase) {
+            rule_ids.push_back(std::to_string(ruleMessage.m_ruleId));
+        }
+    }
+
+    Tracing::SpanPtr span = decoder_callbacks_->activeSpan().spawnChild(
+        Tracing::EgressConfig::get(), absl::StrCat("modsecurity phase ", phase), system_start);
+    span->setTag("modsecurity.phase", std::to_string(phase));
+    span->setTag("modsecurity.duration_us", std::to_string(duration.count()));
+    span->setTag("modsecurity.rule_ids", absl::StrJoin(rule_ids, ","));
+    span->setTag("modsecurity.anomaly_score", std::to_string(anomalyScore()));
+    if (request_phase_ == Phase::Intervened || modsec_transaction_->m_it.disruptive) {
+        span->setTag("modsecurity.intervention", std::to_string(modsec_transaction_->m_it.status));
+    }
+    span->finishSpan();
+}
+
+bool HttpModSecurityFilter::traced() {
+    if (&decoder_callbacks_->activeSpan() == &Tracing::NullSpan::instance()) {
+        return false;
+    }
+    // Same decision as the connection manager's, carried by x-request-id
+    return request_headers_ == nullptr ||
+           Tracing::HttpTracerUtility::isTracing(decoder_callbacks_->streamInfo(), *request_headers_).traced;
+}
+
+void HttpModSecurityFilter::publishSummary() {
+    if (phases_run_ == phases_published_) {
+        return;
+    }
+    phases_published_ = phases_run_;
+    setDynamicMetadata();
+}
+
+void HttpModSecurityFilter::setDynamicMetadata() {
+    ProtobufWkt::Struct metadata;
+    auto& fields = *metadata.mutable_fields();
+    const auto& keys = DynamicMetadataModSecurityKey::get();
+
+    auto* rule_ids = fields[keys.RuleIds].mutable_list_value();
+    for (const auto& ruleMessage : modsec_transaction_->m_rulesMessages) {
+        rule_ids->add_values()->set_number_value(ruleMessage.m_ruleId);
+    }
+    fields[keys.AnomalyScore].set_number_value(anomalyScore());
+    fields[keys.InspectedBytes].set_number_value(modsec_transaction_->getRequestBodyLength() +
+                                                 modsec_transaction_->getResponseBodyLength());
+    fields[keys.TimeUs].set_number_value(phases_time_.count());
+    fields[keys.Intervened].set_bool_value(request_phase_ == Phase::Intervened || modsec_transaction_->m_it.disruptive);
+
+    decoder_callbacks_->streamInfo().setDynamicMetadata(ModSecurityMetadataFilter::get().ModSecurity, metadata);
+}
+
+int HttpModSecurityFilter::anomalyScore() {
+    int score = 0;
+    std::unique_ptr<std::string> value = modsec_transaction_->m_collections.m_tx_collection->resolveFirst("anomaly_score");
+    if (value == nullptr || !absl::SimpleAtoi(*value, &score)) {
+        return 0;
+    }
+    return score;
+}
+
 void HttpModSecurityFilter::_logCb(void *data, const void *ruleMessagev) {
     auto filter_ = reinterpret_cast<HttpModSecurityFilter*>(data);
     auto ruleMessage = reinterpret_cast<const modsecurity::RuleMessage *>(ruleMessagev);
@@ -439,5 +993,15 @@ void HttpModSecurityFilter::logCb(const modsecurity::RuleMessage * ruleMessage)
     // config_->webhook_fetcher()->invoke(getRuleMessageAsJsonString(ruleMessage));
 }
 
+// Filter modes, see createFilter
+template class HttpModSecurityFilterImpl<false, false, false>;
+template class HttpModSecurityFilterImpl<false, false, true>;
+template class HttpModSecurityFilterImpl<false, true, false>;
+template class HttpModSecurityFilterImpl<false, true, true>;
+template class HttpModSecurityFilterImpl<true, false, false>;
+template class HttpModSecurityFilterImpl<true, false, true>;
+template class HttpModSecurityFilterImpl<true, true, false>;
+template class HttpModSecurityFilterImpl<true, true, true>;
+
 } // namespace Http
 } // namespace Envoy
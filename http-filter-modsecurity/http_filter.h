@@ -5,6 +5,11 @@
 #include "common/common/logger.h"
 #include "envoy/server/filter_config.h"
 #include "envoy/thread_local/thread_local.h"
+#include "audit_sink.h"
+#include "body_processor.h"
+#include "inspection_supervisor.h"
+#include "shadow.h"
+#include "worker_context.h"
 #include "well_known_names.h"
 
 #include "http-filter-modsecurity/http_filter.pb.h"
@@ -23,12 +28,29 @@ public:
 
   const envoy::config::filter::http::modsec::v2::Decoder& decoder() const { return decoder_; }
 
+  /**
+   * @return the context of the calling worker
+   */
+  WorkerContext& worker() { return tls_->getTyped<WorkerContext>(); }
+
   std::shared_ptr<modsecurity::ModSecurity> modsec_;
   std::shared_ptr<modsecurity::Rules> modsec_rules_;
+  // Set if audit_log is configured. Before shadow_, whose thread writes to it
+  AuditSinkPtr audit_;
+  // Set if shadow_rules are configured
+  ShadowEvaluatorPtr shadow_;
+  // Set if inspection_engine is configured
+  InspectionSupervisorPtr engine_;
+  // False if the engine's rules can't block (detection_only, SecRuleEngine DetectionOnly or Off),
+  // streams then flow while the engine inspects them
+  bool engine_blocking_;
+  Runtime::RandomGenerator& random_;
 
 private:
+  std::shared_ptr<modsecurity::ModSecurity> newModSecurity();
 
   const envoy::config::filter::http::modsec::v2::Decoder& decoder_;
+  ThreadLocal::SlotPtr tls_;
 };
 
 typedef std::shared_ptr<HttpModSecurityFilterConfig> HttpModSecurityFilterConfigSharedPtr;
@@ -47,9 +69,16 @@ typedef std::shared_ptr<HttpModSecurityFilterConfig> HttpModSecurityFilterConfig
  *               a2b. Response is valid, return Continue
  * 
  * 2. Non-disruptive - always return Continue
+ *
+ * Each direction goes through Phase::Headers -> Phase::Body -> Phase::Done, an intervention moves both to
+ * Phase::Intervened. The decode/encode callbacks are implemented by HttpModSecurityFilterImpl, per filter mode.
+ *
+ * With an inspection engine, the transaction runs in the engine process instead and each checkpoint
+ * (end of headers, end of body) is held with StopIteration until its verdict arrives, or times out.
  *   
  */
 class HttpModSecurityFilter : public StreamFilter,
+                              public InspectionClient::Callbacks,
                               public Logger::Loggable<Logger::Id::filter> {
 public:
   /**
@@ -57,58 +86,199 @@ public:
    */
   static void _logCb(void* data, const void* ruleMessagev);
 
-    HttpModSecurityFilter(HttpModSecurityFilterConfigSharedPtr);
+  HttpModSecurityFilter(HttpModSecurityFilterConfigSharedPtr);
   ~HttpModSecurityFilter();
 
   // Http::StreamFilterBase
   void onDestroy() override;
 
   // Http::StreamDecoderFilter
-  FilterHeadersStatus decodeHeaders(RequestHeaderMap&, bool end_stream) override;
-  FilterDataStatus decodeData(Buffer::Instance&, bool end_stream) override;
   FilterTrailersStatus decodeTrailers(RequestTrailerMap&) override;
   void setDecoderFilterCallbacks(StreamDecoderFilterCallbacks&) override;
 
   // Http::StreamEncoderFilter
   FilterHeadersStatus encode100ContinueHeaders(ResponseHeaderMap& headers) override;
-  FilterHeadersStatus encodeHeaders(ResponseHeaderMap&, bool end_stream) override;
-  FilterDataStatus encodeData(Buffer::Instance&, bool end_stream) override;
   FilterTrailersStatus encodeTrailers(ResponseTrailerMap&) override;
   void setEncoderFilterCallbacks(StreamEncoderFilterCallbacks&) override;
   FilterMetadataStatus encodeMetadata(MetadataMap& metadata_map) override;
 
-private:
+  // InspectionClient::Callbacks
+  void onVerdict(InspectionMessage checkpoint, int status, bool disruptive) override;
+
+protected:
+  /**
+   * Progress of one direction (request or response) of the transaction
+   */
+  enum class Phase : uint8_t {
+    // Headers not processed yet
+    Headers,
+    // Headers processed, the body is being inspected
+    Body,
+    // Fully processed, or not inspected at all
+    Done,
+    // A local reply was sent, set on both directions. Nothing is inspected anymore
+    Intervened,
+  };
+
   const HttpModSecurityFilterConfigSharedPtr config_;
   StreamDecoderFilterCallbacks* decoder_callbacks_;
   StreamEncoderFilterCallbacks* encoder_callbacks_;
   std::shared_ptr<modsecurity::Transaction> modsec_transaction_;
+  // Copy of the request when sampled for the shadow rules, handed over once the request verdict is decided
+  ShadowRequestPtr shadow_request_;
+  // Set when the request body arguments are extracted as the body arrives, see fast_body_arguments
+  BodyArgumentsProcessorPtr body_processor_;
+  // Referenced by the audit log. Header maps live as long as the stream, the data pointers are only set
+  // for the duration of decodeData / encodeData
+  const RequestHeaderMap* request_headers_;
+  const ResponseHeaderMap* response_headers_;
+  const Buffer::Instance* decoding_data_;
+  const Buffer::Instance* encoding_data_;
   
   void logCb(const modsecurity::RuleMessage * ruleMessage);
   /**
-   * @return true if intervention of current transaction is disruptive, false otherwise
+   * @return true if intervention of current transaction is disruptive, false otherwise.
+   * Non blocking filters only audit log the intervention.
+   */
+  template <bool Blocking> bool interventionLog();
+  /**
+   * Writes the audit log record through the audit_log sink: headers and bodies come from envoy, ModSecurity
+   * formats the other parts
+   */
+  void writeAuditRecord();
+  /**
+   * Sends a local reply with the given code, moving both directions to Phase::Intervened
    */
-  bool interventionLog();
+  void intervene(Http::Code code);
+  /**
+   * @return true if the rules may block, in which case a direction is held until its body is processed
+   */
+  bool holdUntilProcessed() {
+    return modsec_transaction_->getRuleEngineState() == modsecurity::Rules::EnabledRuleEngine;
+  }
+  /**
+   * Hand the sampled request over to the shadow rules, if the primary verdict of the request is decided
+   */
+  void submitShadow();
 
-  FilterHeadersStatus getRequestHeadersStatus();
-  FilterDataStatus getRequestStatus();
+  /**
+   * @return true if the route disables the inspection of the request. Also reads no_audit_log
+   */
+  bool requestDisabled();
+  /**
+   * @return true if the route disables the inspection of the response
+   */
+  bool responseDisabled();
 
-  FilterHeadersStatus getResponseHeadersStatus();
-  FilterDataStatus getResponseStatus();
+  // In-process ModSecurity phases. Each returns true if the transaction was intervened
+  template <bool Blocking> bool processRequestHeaders(RequestHeaderMap& headers);
+  template <bool Blocking> bool processRequestBody();
+  template <bool Blocking> bool processResponseHeaders(ResponseHeaderMap& headers);
+  template <bool Blocking> bool processResponseBody();
 
-  void generateBoundary(std::string *boundary);
+  /**
+   * Times a ModSecurity phase for its lifetime, see endPhase
+   */
+  class PhaseScope;
+  /**
+   * Accounts a finished ModSecurity phase, and reports it as a child span of the active span if the stream is traced
+   */
+  void endPhase(int phase, SystemTime system_start, MonotonicTime start);
+  /**
+   * @return false if the active span is the NullSpan, or the stream isn't sampled
+   */
+  bool traced();
+  /**
+   * Publishes the summary if phases ran since it was last published: once the request verdict is final,
+   * for the filters further down, and again once the response verdict is final, for the access logs
+   */
+  void publishSummary();
+  /**
+   * Sets a summary of the transaction (score, rule ids, inspected bytes, time spent) as dynamic metadata
+   */
+  void setDynamicMetadata();
+  /**
+   * @return the anomaly score set by the rules (tx.anomaly_score), 0 if not set
+   */
+  int anomalyScore();
+
+  // Inspection engine counterparts of the decode/encode methods
+  FilterHeadersStatus inspectRequestHeaders(RequestHeaderMap& headers, bool end_stream);
+  FilterDataStatus inspectRequestBody(Buffer::Instance& data, bool end_stream);
+  FilterHeadersStatus inspectResponseHeaders(ResponseHeaderMap& headers, bool end_stream);
+  FilterDataStatus inspectResponseBody(Buffer::Instance& data, bool end_stream);
+  void armInspectionTimer();
+  void onInspectionTimeout();
+  /**
+   * Applies the fail policy when the engine can't be reached
+   * @return true if the stream was stopped by a local reply (fail closed), false otherwise
+   */
+  bool inspectionUnavailable();
 
-  // This bool is set by intervention before generating a local reply.
-  // Once set, it means that for this http session is already intervined and any subsequent call to the filter's methods
-  // will return ::Continue.
-  // This is to allow the local reply to flow back to the downstream.
-  bool intervined_;
+  // Set when the transaction runs in the inspection engine
+  InspectionClient* inspection_;
+  uint64_t inspection_stream_id_;
+  Event::TimerPtr inspection_timer_;
+  uint32_t request_verdicts_pending_;
+  uint32_t response_verdicts_pending_;
+  bool inspection_started_;
+  bool inspection_failed_;
+  // Set while we returned StopIteration and owe a continueDecoding / continueEncoding
+  bool decoding_stopped_;
+  bool encoding_stopped_;
+
+  // Once Intervened, any subsequent call to the filter's methods lets the local reply flow back to the downstream.
+  Phase request_phase_;
+  Phase response_phase_;
   bool logged_;
-  bool request_processed_;
-  bool response_processed_;
   bool no_audit_log_;
-  // TODO - convert three booleans to state?
+  // Time spent in ModSecurity phases
+  std::chrono::microseconds phases_time_;
+  uint32_t phases_run_;
+  // phases_run_ when the summary was last published
+  uint32_t phases_published_;
+};
+
+/**
+ * The decode/encode callbacks of a filter mode, branches a mode doesn't need are compiled out.
+ * Instantiated by createFilter for each combination of the detection_only, headers_only and disable_response options.
+ * @tparam Blocking if false (detection_only), the filter never holds nor blocks the traffic
+ * @tparam InspectBodies if false (headers_only), bodies are never touched. Phases 2 and 4 run right after the headers
+ * @tparam InspectResponse if false (disable_response), phases 3 and 4 never run
+ */
+template <bool Blocking, bool InspectBodies, bool InspectResponse>
+class HttpModSecurityFilterImpl : public HttpModSecurityFilter {
+public:
+  using HttpModSecurityFilter::HttpModSecurityFilter;
+
+  // Http::StreamDecoderFilter
+  FilterHeadersStatus decodeHeaders(RequestHeaderMap&, bool end_stream) override;
+  FilterDataStatus decodeData(Buffer::Instance&, bool end_stream) override;
+
+  // Http::StreamEncoderFilter
+  FilterHeadersStatus encodeHeaders(ResponseHeaderMap&, bool end_stream) override;
+  FilterDataStatus encodeData(Buffer::Instance&, bool end_stream) override;
+
+private:
+  // Only the default and detection_only modes run with an inspection engine
+  static constexpr bool Engine = InspectBodies && InspectResponse;
+
+  FilterHeadersStatus getRequestHeadersStatus();
+  FilterDataStatus getRequestStatus();
+
+  FilterHeadersStatus getResponseHeadersStatus();
+  FilterDataStatus getResponseStatus();
 };
 
+// Defined in http_filter.cc
+extern template class HttpModSecurityFilterImpl<false, false, false>;
+extern template class HttpModSecurityFilterImpl<false, false, true>;
+extern template class HttpModSecurityFilterImpl<false, true, false>;
+extern template class HttpModSecurityFilterImpl<false, true, true>;
+extern template class HttpModSecurityFilterImpl<true, false, false>;
+extern template class HttpModSecurityFilterImpl<true, false, true>;
+extern template class HttpModSecurityFilterImpl<true, true, false>;
+extern template class HttpModSecurityFilterImpl<true, true, true>;
 
 } // namespace Http
 } // namespace Envoy
@@ -39,9 +39,25 @@ private:
     Http::HttpModSecurityFilterConfigSharedPtr config =
         std::make_shared<Http::HttpModSecurityFilterConfig>(proto_config, context);
 
+    typedef Http::FilterFactoryCb (*FilterFactory)(Http::HttpModSecurityFilterConfigSharedPtr);
+    // Indexed by [blocking][inspect bodies][inspect response]
+    static const FilterFactory factories[2][2][2] = {
+        {{filterFactory<false, false, false>, filterFactory<false, false, true>},
+         {filterFactory<false, true, false>, filterFactory<false, true, true>}},
+        {{filterFactory<true, false, false>, filterFactory<true, false, true>},
+         {filterFactory<true, true, false>, filterFactory<true, true, true>}},
+    };
+    return factories[!proto_config.detection_only()][!proto_config.headers_only()][!proto_config.disable_response()](config);
+  }
+
+  /**
+   * Each filter mode is its own class, so that callbacks only carry the branches of their mode
+   */
+  template <bool Blocking, bool InspectBodies, bool InspectResponse>
+  static Http::FilterFactoryCb filterFactory(Http::HttpModSecurityFilterConfigSharedPtr config) {
     return [config](Http::FilterChainFactoryCallbacks& callbacks) -> void {
       callbacks.addStreamFilter(
-        std::make_shared<Http::HttpModSecurityFilter>(config)
+        std::make_shared<Http::HttpModSecurityFilterImpl<Blocking, InspectBodies, InspectResponse>>(config)
       );
     };
   }
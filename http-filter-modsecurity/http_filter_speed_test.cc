@@ -0,0 +1,364 @@
+// Scaling of ModSecurity transactions over worker threads, each benchmark thread standing for an envoy worker.
+// Run with --benchmark_counters_tabular=true: requests_per_second should grow linearly with the number of threads
+// for the per worker variant, up to the number of cores.
+//
+// BM_FilterWorkers measures the same through the filter: real worker threads running their own dispatcher, the
+// filter reaching its WorkerContext through the config's thread local slot as it does in envoy.
+//
+// Also compares the cost of the filter callbacks for each filter mode (BM_FilterMode), on a single worker.
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/blocking_counter.h"
+#include "common/buffer/buffer_impl.h"
+#include "common/event/real_time_system.h"
+#include "common/network/utility.h"
+#include "common/stream_info/stream_info_impl.h"
+#include "common/thread_local/thread_local_impl.h"
+#include "common/tracing/http_tracer_impl.h"
+
+#include "http_filter.h"
+#include "worker_context.h"
+
+#include "test/mocks/http/mocks.h"
+#include "test/mocks/network/mocks.h"
+#include "test/mocks/router/mocks.h"
+#include "test/mocks/server/mocks.h"
+#include "test/test_common/utility.h"
+
+#include "benchmark/benchmark.h"
+#include "gmock/gmock.h"
+
+namespace Envoy {
+namespace Http {
+namespace {
+
+// A few rules of each kind run by CRS on every request. No persistent collections, those are per worker with
+// per_worker_modsecurity.
+const char* Rules = R"(
+SecRuleEngine On
+SecRequestBodyAccess On
+SecResponseBodyAccess On
+SecResponseBodyMimeType text/plain
+SecAction "id:900000,phase:1,nolog,pass,setvar:tx.anomaly_score=0"
+SecRule REQUEST_HEADERS:User-Agent "@pm nikto sqlmap nessus" "id:913100,phase:1,pass,log,setvar:tx.anomaly_score=+5"
+SecRule REQUEST_URI|ARGS "@rx (?i)<script[^>]*>" "id:941100,phase:2,pass,log,t:urlDecodeUni,setvar:tx.anomaly_score=+5"
+SecRule ARGS "@rx (?i)\bunion\b.{1,100}?\bselect\b" "id:942100,phase:2,pass,log,t:urlDecodeUni,setvar:tx.anomaly_score=+5"
+SecRule ARGS "@detectSQLi" "id:942101,phase:2,pass,log,setvar:tx.anomaly_score=+5"
+SecRule TX:ANOMALY_SCORE "@ge 10" "id:949110,phase:2,deny,status:403,log"
+SecRule RESPONSE_BODY "@rx (?i)sql syntax.*mysql" "id:951100,phase:4,pass,log"
+)";
+
+const std::string RequestBody = "name=John+Doe&email=john%40example.com&comment=Looks+good+to+me&page=3";
+const std::string ResponseBody(4096, 'x');
+
+class ModSecurityFixture {
+public:
+  ModSecurityFixture() : shared_modsec_(std::make_shared<modsecurity::ModSecurity>()), rules_(new modsecurity::Rules()) {
+    if (rules_->load(Rules) < 0) {
+      throw std::runtime_error(rules_->getParserError());
+    }
+  }
+
+  std::shared_ptr<modsecurity::ModSecurity> shared_modsec_;
+  std::unique_ptr<modsecurity::Rules> rules_;
+  Event::RealTimeSystem time_system_;
+};
+
+ModSecurityFixture& fixture() {
+  static ModSecurityFixture* fixture = new ModSecurityFixture();
+  return *fixture;
+}
+
+// One request and response, as the filter runs them
+void runTransaction(WorkerContext& worker, modsecurity::Rules& rules) {
+  std::unique_ptr<modsecurity::Transaction> transaction(worker.newTransaction(rules, nullptr));
+  transaction->processConnection("10.0.0.1", 34567, "10.0.0.2", 80);
+  transaction->processURI("/app/comments?page=3&sort=desc", "POST", "1.1");
+  transaction->addRequestHeader(":authority", "example.com");
+  transaction->addRequestHeader("Host", "example.com");
+  transaction->addRequestHeader("User-Agent", "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36");
+  transaction->addRequestHeader("Accept", "text/html,application/xhtml+xml");
+  transaction->addRequestHeader("Content-Type", "application/x-www-form-urlencoded");
+  transaction->addRequestHeader("Content-Length", std::to_string(RequestBody.size()));
+  transaction->processRequestHeaders();
+  transaction->appendRequestBody(reinterpret_cast<const unsigned char*>(RequestBody.data()), RequestBody.size());
+  transaction->processRequestBody();
+  transaction->addResponseHeader("Content-Type", "text/plain");
+  transaction->processResponseHeaders(200, "HTTP 1.1");
+  transaction->appendResponseBody(reinterpret_cast<const unsigned char*>(ResponseBody.data()), ResponseBody.size());
+  transaction->processResponseBody();
+  transaction->processLogging();
+  benchmark::DoNotOptimize(transaction->m_it.disruptive);
+}
+
+void runWorker(benchmark::State& state, bool per_worker_modsecurity) {
+  ModSecurityFixture& f = fixture();
+  WorkerContext worker(per_worker_modsecurity ? std::make_shared<modsecurity::ModSecurity>() : f.shared_modsec_,
+                       state.thread_index + 1, f.time_system_);
+  for (auto _ : state) {
+    runTransaction(worker, *f.rules_);
+  }
+  state.counters["requests_per_second"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+}
+
+// All workers share the config's ModSecurity instance (the default)
+static void BM_SharedModSecurity(benchmark::State& state) {
+  runWorker(state, false);
+}
+BENCHMARK(BM_SharedModSecurity)->ThreadRange(1, std::thread::hardware_concurrency())->UseRealTime();
+
+// per_worker_modsecurity
+static void BM_PerWorkerModSecurity(benchmark::State& state) {
+  runWorker(state, true);
+}
+BENCHMARK(BM_PerWorkerModSecurity)->ThreadRange(1, std::thread::hardware_concurrency())->UseRealTime();
+
+// What the filter reads from its callbacks, set up ahead of the streams. The callbacks below return these fields
+// instead of going through gmock, whose expectations take a global lock: only the mocks' constructors and the
+// methods the filter never calls are left to gmock.
+class StubConnection : public Network::MockConnection {
+public:
+  const Network::Address::InstanceConstSharedPtr& localAddress() const override { return local_address_; }
+};
+
+class StubRouteEntry : public Router::MockRouteEntry {
+public:
+  const envoy::config::core::v3::Metadata& metadata() const override { return stub_metadata_; }
+
+  envoy::config::core::v3::Metadata stub_metadata_;
+};
+
+class StubRoute : public Router::MockRoute {
+public:
+  const Router::RouteEntry* routeEntry() const override { return &stub_route_entry_; }
+
+  StubRouteEntry stub_route_entry_;
+};
+
+struct StreamState {
+  Event::Dispatcher* dispatcher;
+  StubConnection connection;
+  Router::RouteConstSharedPtr route;
+  // Per stream, as the dynamic metadata accumulates in it
+  std::unique_ptr<StreamInfo::StreamInfoImpl> stream_info;
+};
+
+class StubDecoderFilterCallbacks : public MockStreamDecoderFilterCallbacks {
+public:
+  explicit StubDecoderFilterCallbacks(StreamState& state) : state_(state) {}
+
+  const Network::Connection* connection() override { return &state_.connection; }
+  Event::Dispatcher& dispatcher() override { return *state_.dispatcher; }
+  Router::RouteConstSharedPtr route() override { return state_.route; }
+  StreamInfo::StreamInfo& streamInfo() override { return *state_.stream_info; }
+  Tracing::Span& activeSpan() override { return Tracing::NullSpan::instance(); }
+
+private:
+  StreamState& state_;
+};
+
+class StubEncoderFilterCallbacks : public MockStreamEncoderFilterCallbacks {
+public:
+  explicit StubEncoderFilterCallbacks(StreamState& state) : state_(state) {}
+
+  Event::Dispatcher& dispatcher() override { return *state_.dispatcher; }
+  Router::RouteConstSharedPtr route() override { return state_.route; }
+  StreamInfo::StreamInfo& streamInfo() override { return *state_.stream_info; }
+
+private:
+  StreamState& state_;
+};
+
+// Callbacks of the streams run by one worker
+class StreamCallbacks {
+public:
+  explicit StreamCallbacks(Event::Dispatcher& dispatcher) : decoder_callbacks_(state_), encoder_callbacks_(state_) {
+    state_.dispatcher = &dispatcher;
+    state_.connection.local_address_ = Network::Utility::parseInternetAddress("10.0.0.2", 80);
+    state_.route = std::make_shared<testing::NiceMock<StubRoute>>();
+    local_address_ = Network::Utility::parseInternetAddress("10.0.0.1", 34567);
+  }
+
+  /**
+   * Fresh stream info for the next stream, as the connection manager creates one per stream
+   */
+  void newStream() {
+    state_.stream_info =
+        std::make_unique<StreamInfo::StreamInfoImpl>(Protocol::Http11, state_.dispatcher->timeSource());
+    state_.stream_info->setDownstreamLocalAddress(local_address_);
+  }
+
+  StreamState state_;
+  Network::Address::InstanceConstSharedPtr local_address_;
+  testing::NiceMock<StubDecoderFilterCallbacks> decoder_callbacks_;
+  testing::NiceMock<StubEncoderFilterCallbacks> encoder_callbacks_;
+};
+
+class FilterFixture {
+public:
+  FilterFixture() : api_(Api::createApiForTest()), dispatcher_(api_->allocateDispatcher("main_thread")),
+                    callbacks_(*dispatcher_) {
+    proto_config_.add_rules_inline(Rules);
+    config_ = std::make_shared<HttpModSecurityFilterConfig>(proto_config_, context_);
+  }
+
+  Api::ApiPtr api_;
+  Event::DispatcherPtr dispatcher_;
+  envoy::config::filter::http::modsec::v2::Decoder proto_config_;
+  testing::NiceMock<Server::Configuration::MockFactoryContext> context_;
+  HttpModSecurityFilterConfigSharedPtr config_;
+  StreamCallbacks callbacks_;
+};
+
+// Body slices per direction
+constexpr int Chunks = 8;
+
+// One request and response through the filter, as the connection manager drives it
+template <bool Blocking, bool InspectBodies, bool InspectResponse>
+void runStream(const HttpModSecurityFilterConfigSharedPtr& config, StreamCallbacks& callbacks) {
+  callbacks.newStream();
+  HttpModSecurityFilterImpl<Blocking, InspectBodies, InspectResponse> filter(config);
+  filter.setDecoderFilterCallbacks(callbacks.decoder_callbacks_);
+  filter.setEncoderFilterCallbacks(callbacks.encoder_callbacks_);
+  TestRequestHeaderMapImpl request_headers{{":method", "POST"},
+                                           {":path", "/app/comments?page=3&sort=desc"},
+                                           {":authority", "example.com"},
+                                           {"user-agent", "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36"},
+                                           {"content-type", "application/x-www-form-urlencoded"}};
+  filter.decodeHeaders(request_headers, false);
+  for (int i = 0; i < Chunks; i++) {
+    Buffer::OwnedImpl chunk(RequestBody);
+    filter.decodeData(chunk, i == Chunks - 1);
+  }
+  TestResponseHeaderMapImpl response_headers{{":status", "200"}, {"content-type", "text/plain"}};
+  filter.encodeHeaders(response_headers, false);
+  for (int i = 0; i < Chunks; i++) {
+    Buffer::OwnedImpl chunk(ResponseBody);
+    filter.encodeData(chunk, i == Chunks - 1);
+  }
+  filter.onDestroy();
+}
+
+template <bool Blocking, bool InspectBodies, bool InspectResponse>
+static void BM_FilterMode(benchmark::State& state) {
+  static FilterFixture* f = new FilterFixture();
+  for (auto _ : state) {
+    runStream<Blocking, InspectBodies, InspectResponse>(f->config_, f->callbacks_);
+  }
+  state.counters["callbacks_per_second"] =
+      benchmark::Counter(state.iterations() * (2 + 2 * Chunks), benchmark::Counter::kIsRate);
+}
+// Default
+BENCHMARK_TEMPLATE(BM_FilterMode, true, true, true);
+// disable_response
+BENCHMARK_TEMPLATE(BM_FilterMode, true, true, false);
+// headers_only
+BENCHMARK_TEMPLATE(BM_FilterMode, true, false, true);
+// detection_only
+BENCHMARK_TEMPLATE(BM_FilterMode, false, true, true);
+// detection_only, headers_only
+BENCHMARK_TEMPLATE(BM_FilterMode, false, false, true);
+// detection_only, headers_only, disable_response
+BENCHMARK_TEMPLATE(BM_FilterMode, false, false, false);
+
+// Envoy's threading as the filter sees it: a main thread creating the configs, and worker threads each running
+// a dispatcher, the thread local slots being set on every worker through its dispatcher.
+class WorkersFixture {
+public:
+  struct Worker {
+    Event::DispatcherPtr dispatcher;
+    std::thread thread;
+    std::unique_ptr<StreamCallbacks> callbacks;
+  };
+
+  WorkersFixture() : api_(Api::createApiForTest()), main_dispatcher_(api_->allocateDispatcher("main_thread")) {
+    tls_.registerThread(*main_dispatcher_, true);
+    workers_.resize(std::thread::hardware_concurrency());
+    for (size_t i = 0; i < workers_.size(); i++) {
+      workers_[i] = std::make_unique<Worker>();
+      workers_[i]->dispatcher = api_->allocateDispatcher(absl::StrCat("worker_", i));
+      workers_[i]->callbacks = std::make_unique<StreamCallbacks>(*workers_[i]->dispatcher);
+      tls_.registerThread(*workers_[i]->dispatcher, false);
+    }
+    ON_CALL(context_, threadLocal()).WillByDefault(testing::ReturnRef(tls_));
+
+    // Configs are created after the workers registered, their slots are set on every worker
+    proto_config_.add_rules_inline(Rules);
+    per_worker_proto_config_.add_rules_inline(Rules);
+    per_worker_proto_config_.set_per_worker_modsecurity(true);
+    config_ = std::make_shared<HttpModSecurityFilterConfig>(proto_config_, context_);
+    per_worker_config_ = std::make_shared<HttpModSecurityFilterConfig>(per_worker_proto_config_, context_);
+
+    for (auto& worker : workers_) {
+      Event::Dispatcher& dispatcher = *worker->dispatcher;
+      worker->thread = std::thread([&dispatcher]() -> void {
+        dispatcher.run(Event::Dispatcher::RunType::RunUntilExit);
+      });
+    }
+  }
+
+  Api::ApiPtr api_;
+  Event::DispatcherPtr main_dispatcher_;
+  ThreadLocal::InstanceImpl tls_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  envoy::config::filter::http::modsec::v2::Decoder proto_config_;
+  envoy::config::filter::http::modsec::v2::Decoder per_worker_proto_config_;
+  testing::NiceMock<Server::Configuration::MockFactoryContext> context_;
+  HttpModSecurityFilterConfigSharedPtr config_;
+  HttpModSecurityFilterConfigSharedPtr per_worker_config_;
+};
+
+// Streams a worker runs per benchmark iteration
+constexpr int StreamsPerWorker = 16;
+
+// The first range(0) workers each run StreamsPerWorker streams per iteration, range(1) selects per_worker_modsecurity
+static void BM_FilterWorkers(benchmark::State& state) {
+  static WorkersFixture* f = new WorkersFixture();
+  const size_t workers = std::min<size_t>(state.range(0), f->workers_.size());
+  const HttpModSecurityFilterConfigSharedPtr& config = state.range(1) ? f->per_worker_config_ : f->config_;
+  for (auto _ : state) {
+    absl::BlockingCounter done(workers);
+    for (size_t i = 0; i < workers; i++) {
+      StreamCallbacks& callbacks = *f->workers_[i]->callbacks;
+      f->workers_[i]->dispatcher->post([&config, &callbacks, &done]() -> void {
+        for (int s = 0; s < StreamsPerWorker; s++) {
+          runStream<true, true, true>(config, callbacks);
+        }
+        done.DecrementCount();
+      });
+    }
+    done.Wait();
+  }
+  state.counters["requests_per_second"] =
+      benchmark::Counter(state.iterations() * workers * StreamsPerWorker, benchmark::Counter::kIsRate);
+}
+static void workerArgs(benchmark::internal::Benchmark* b) {
+  const int cores = std::thread::hardware_concurrency();
+  for (int per_worker_modsecurity = 0; per_worker_modsecurity <= 1; per_worker_modsecurity++) {
+    for (int workers = 1; workers < cores; workers *= 2) {
+      b->Args({workers, per_worker_modsecurity});
+    }
+    b->Args({cores, per_worker_modsecurity});
+  }
+}
+BENCHMARK(BM_FilterWorkers)->Apply(workerArgs)->ArgNames({"workers", "per_worker_modsecurity"})->UseRealTime();
+
+} // namespace
+} // namespace Http
+} // namespace Envoy
+
+// Boilerplate main(), which discovers benchmarks in the same file and runs them.
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+}
@@ -0,0 +1,411 @@
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "absl/strings/str_cat.h"
+#include "common/buffer/buffer_impl.h"
+#include "common/network/utility.h"
+#include "common/tracing/http_tracer_impl.h"
+
+#include "http_filter.h"
+
+#include "test/mocks/http/mocks.h"
+#include "test/mocks/network/mocks.h"
+#include "test/mocks/server/mocks.h"
+#include "test/mocks/tracing/mocks.h"
+#include "test/test_common/utility.h"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+using testing::_;
+using testing::Eq;
+using testing::InSequence;
+using testing::Return;
+using testing::ReturnRef;
+using testing::SaveArg;
+
+namespace Envoy {
+namespace Http {
+namespace {
+
+// One blocking rule per phase, triggered by an x-block-phase header or a body keyword.
+// An x-score header sets the anomaly score, ahead of the blocking rules
+const char* Rules = R"(
+SecRuleEngine On
+SecRequestBodyAccess On
+SecResponseBodyAccess On
+SecResponseBodyMimeType text/plain
+SecRule &REQUEST_HEADERS:X-Score "@eq 1" "id:6,phase:1,pass,log,setvar:tx.anomaly_score=5"
+SecRule REQUEST_HEADERS:X-Block-Phase "@streq 1" "id:1,phase:1,deny,status:403,log"
+SecRule REQUEST_HEADERS:X-Block-Phase "@streq 2" "id:2,phase:2,deny,status:403,log"
+SecRule REQUEST_BODY "@contains attack" "id:3,phase:2,deny,status:403,log"
+SecRule RESPONSE_HEADERS:X-Block-Phase "@streq 3" "id:4,phase:3,deny,status:403,log"
+SecRule RESPONSE_BODY "@contains leak" "id:5,phase:4,deny,status:403,log"
+)";
+
+// x-request-id of a request sampled by the connection manager, and of one that isn't
+const char* SampledRequestId = "a121e9e1-feae-9136-9e0e-6fac343d56c9";
+const char* UnsampledRequestId = "a121e9e1-feae-4136-9e0e-6fac343d56c9";
+
+class HttpModSecurityFilterTest : public testing::Test {
+public:
+  HttpModSecurityFilterTest() {
+    proto_config_.add_rules_inline(Rules);
+    config_ = std::make_shared<HttpModSecurityFilterConfig>(proto_config_, context_);
+    connection_.local_address_ = Network::Utility::parseInternetAddress("10.0.0.2", 80);
+    decoder_callbacks_.stream_info_.downstream_local_address_ =
+        Network::Utility::parseInternetAddress("10.0.0.1", 34567);
+    ON_CALL(decoder_callbacks_, connection()).WillByDefault(Return(&connection_));
+    ON_CALL(decoder_callbacks_, activeSpan()).WillByDefault(ReturnRef(Tracing::NullSpan::instance()));
+  }
+
+  template <bool Blocking, bool InspectBodies, bool InspectResponse> void createFilter() {
+    filter_ = std::make_unique<HttpModSecurityFilterImpl<Blocking, InspectBodies, InspectResponse>>(config_);
+    filter_->setDecoderFilterCallbacks(decoder_callbacks_);
+    filter_->setEncoderFilterCallbacks(encoder_callbacks_);
+  }
+
+  TestRequestHeaderMapImpl requestHeaders(const std::string& block_phase = "") {
+    TestRequestHeaderMapImpl headers{{":method", "POST"},
+                                     {":path", "/comments"},
+                                     {":authority", "example.com"},
+                                     {"content-type", "text/plain"}};
+    if (!block_phase.empty()) {
+      headers.addCopy("x-block-phase", block_phase);
+    }
+    return headers;
+  }
+
+  TestResponseHeaderMapImpl responseHeaders(const std::string& block_phase = "") {
+    TestResponseHeaderMapImpl headers{{":status", "200"}, {"content-type", "text/plain"}};
+    if (!block_phase.empty()) {
+      headers.addCopy("x-block-phase", block_phase);
+    }
+    return headers;
+  }
+
+  FilterDataStatus decodeData(const std::string& body, bool end_stream) {
+    Buffer::OwnedImpl data(body);
+    return filter_->decodeData(data, end_stream);
+  }
+
+  FilterDataStatus encodeData(const std::string& body, bool end_stream) {
+    Buffer::OwnedImpl data(body);
+    return filter_->encodeData(data, end_stream);
+  }
+
+  void expectLocalReply(int times) {
+    EXPECT_CALL(decoder_callbacks_, sendLocalReply(Code::Forbidden, _, _, _, _)).Times(times);
+  }
+
+  envoy::config::filter::http::modsec::v2::Decoder proto_config_;
+  testing::NiceMock<Server::Configuration::MockFactoryContext> context_;
+  HttpModSecurityFilterConfigSharedPtr config_;
+  testing::NiceMock<Network::MockConnection> connection_;
+  testing::NiceMock<MockStreamDecoderFilterCallbacks> decoder_callbacks_;
+  testing::NiceMock<MockStreamEncoderFilterCallbacks> encoder_callbacks_;
+  std::unique_ptr<HttpModSecurityFilter> filter_;
+};
+
+// Default mode: bodies are held until their phase ran
+TEST_F(HttpModSecurityFilterTest, DefaultHoldsBodies) {
+  createFilter<true, true, true>();
+  expectLocalReply(0);
+  auto request_headers = requestHeaders();
+  EXPECT_EQ(FilterHeadersStatus::StopIteration, filter_->decodeHeaders(request_headers, false));
+  EXPECT_EQ(FilterDataStatus::StopIterationAndBuffer, decodeData("hello ", false));
+  EXPECT_EQ(FilterDataStatus::Continue, decodeData("world", true));
+  auto response_headers = responseHeaders();
+  EXPECT_EQ(FilterHeadersStatus::StopIteration, filter_->encodeHeaders(response_headers, false));
+  EXPECT_EQ(FilterDataStatus::StopIterationAndBuffer, encodeData("hello ", false));
+  EXPECT_EQ(FilterDataStatus::Continue, encodeData("world", true));
+  filter_->onDestroy();
+}
+
+TEST_F(HttpModSecurityFilterTest, DefaultBlocksRequestHeaders) {
+  createFilter<true, true, true>();
+  expectLocalReply(1);
+  auto request_headers = requestHeaders("1");
+  EXPECT_EQ(FilterHeadersStatus::StopIteration, filter_->decodeHeaders(request_headers, false));
+  filter_->onDestroy();
+}
+
+TEST_F(HttpModSecurityFilterTest, DefaultBlocksRequestBody) {
+  createFilter<true, true, true>();
+  expectLocalReply(1);
+  auto request_headers = requestHeaders();
+  EXPECT_EQ(FilterHeadersStatus::StopIteration, filter_->decodeHeaders(request_headers, false));
+  EXPECT_EQ(FilterDataStatus::StopIterationAndBuffer, decodeData("an ", false));
+  EXPECT_EQ(FilterDataStatus::StopIterationNoBuffer, decodeData("attack", true));
+  filter_->onDestroy();
+}
+
+TEST_F(HttpModSecurityFilterTest, DefaultBlocksResponseHeaders) {
+  createFilter<true, true, true>();
+  expectLocalReply(1);
+  auto request_headers = requestHeaders();
+  EXPECT_EQ(FilterHeadersStatus::Continue, filter_->decodeHeaders(request_headers, true));
+  auto response_headers = responseHeaders("3");
+  EXPECT_EQ(FilterHeadersStatus::StopIteration, filter_->encodeHeaders(response_headers, false));
+  filter_->onDestroy();
+}
+
+TEST_F(HttpModSecurityFilterTest, DefaultBlocksResponseBody) {
+  createFilter<true, true, true>();
+  expectLocalReply(1);
+  auto request_headers = requestHeaders();
+  EXPECT_EQ(FilterHeadersStatus::Continue, filter_->decodeHeaders(request_headers, true));
+  auto response_headers = responseHeaders();
+  EXPECT_EQ(FilterHeadersStatus::StopIteration, filter_->encodeHeaders(response_headers, false));
+  EXPECT_EQ(FilterDataStatus::StopIterationNoBuffer, encodeData("a leak", true));
+  filter_->onDestroy();
+}
+
+// Once intervened, the rest of the request is dropped, the local reply flows and nothing is inspected anymore
+TEST_F(HttpModSecurityFilterTest, AfterIntervention) {
+  createFilter<true, true, true>();
+  expectLocalReply(1);
+  auto request_headers = requestHeaders("1");
+  EXPECT_EQ(FilterHeadersStatus::StopIteration, filter_->decodeHeaders(request_headers, false));
+  EXPECT_EQ(FilterDataStatus::StopIterationNoBuffer, decodeData("an attack", true));
+  // The local reply, which would match the response rules
+  auto response_headers = responseHeaders("3");
+  response_headers.setStatus(403);
+  EXPECT_EQ(FilterHeadersStatus::Continue, filter_->encodeHeaders(response_headers, false));
+  EXPECT_EQ(FilterDataStatus::Continue, encodeData("a leak", true));
+  filter_->onDestroy();
+}
+
+// headers_only: nothing is buffered, phase 2 and 4 rules run on the headers
+TEST_F(HttpModSecurityFilterTest, HeadersOnly) {
+  createFilter<true, false, true>();
+  expectLocalReply(0);
+  auto request_headers = requestHeaders();
+  EXPECT_EQ(FilterHeadersStatus::Continue, filter_->decodeHeaders(request_headers, false));
+  EXPECT_EQ(FilterDataStatus::Continue, decodeData("an attack", false));
+  EXPECT_EQ(FilterDataStatus::Continue, decodeData("another attack", true));
+  auto response_headers = responseHeaders();
+  EXPECT_EQ(FilterHeadersStatus::Continue, filter_->encodeHeaders(response_headers, false));
+  EXPECT_EQ(FilterDataStatus::Continue, encodeData("a leak", true));
+  filter_->onDestroy();
+}
+
+TEST_F(HttpModSecurityFilterTest, HeadersOnlyBlocksPhase2OnHeaders) {
+  createFilter<true, false, true>();
+  expectLocalReply(1);
+  auto request_headers = requestHeaders("2");
+  EXPECT_EQ(FilterHeadersStatus::StopIteration, filter_->decodeHeaders(request_headers, false));
+  EXPECT_EQ(FilterDataStatus::StopIterationNoBuffer, decodeData("body", true));
+  filter_->onDestroy();
+}
+
+// disable_response: responses are never held nor inspected
+TEST_F(HttpModSecurityFilterTest, DisableResponse) {
+  createFilter<true, true, false>();
+  expectLocalReply(0);
+  auto request_headers = requestHeaders();
+  EXPECT_EQ(FilterHeadersStatus::StopIteration, filter_->decodeHeaders(request_headers, false));
+  EXPECT_EQ(FilterDataStatus::Continue, decodeData("hello", true));
+  auto response_headers = responseHeaders("3");
+  EXPECT_EQ(FilterHeadersStatus::Continue, filter_->encodeHeaders(response_headers, false));
+  EXPECT_EQ(FilterDataStatus::Continue, encodeData("a leak", true));
+  filter_->onDestroy();
+}
+
+// detection_only: rules match but nothing is held nor answered locally
+TEST_F(HttpModSecurityFilterTest, DetectionOnly) {
+  createFilter<false, true, true>();
+  expectLocalReply(0);
+  auto request_headers = requestHeaders("1");
+  EXPECT_EQ(FilterHeadersStatus::Continue, filter_->decodeHeaders(request_headers, false));
+  EXPECT_EQ(FilterDataStatus::Continue, decodeData("an ", false));
+  EXPECT_EQ(FilterDataStatus::Continue, decodeData("attack", true));
+  auto response_headers = responseHeaders("3");
+  EXPECT_EQ(FilterHeadersStatus::Continue, filter_->encodeHeaders(response_headers, false));
+  EXPECT_EQ(FilterDataStatus::Continue, encodeData("a leak", true));
+  filter_->onDestroy();
+}
+
+// The summary is published once the request verdict is final, and updated once the response verdict is final
+TEST_F(HttpModSecurityFilterTest, DynamicMetadata) {
+  createFilter<true, true, true>();
+  const auto& keys = DynamicMetadataModSecurityKey::get();
+  ProtobufWkt::Struct metadata;
+  EXPECT_CALL(decoder_callbacks_.stream_info_, setDynamicMetadata("envoy.filters.http.modsecurity", _))
+      .WillOnce(SaveArg<1>(&metadata));
+  auto request_headers = requestHeaders();
+  request_headers.addCopy("x-score", "1");
+  EXPECT_EQ(FilterHeadersStatus::StopIteration, filter_->decodeHeaders(request_headers, false));
+  EXPECT_EQ(FilterDataStatus::Continue, decodeData("hello", true));
+  testing::Mock::VerifyAndClearExpectations(&decoder_callbacks_.stream_info_);
+
+  const auto& request_fields = metadata.fields();
+  ASSERT_EQ(1, request_fields.at(keys.RuleIds).list_value().values_size());
+  EXPECT_EQ(6, request_fields.at(keys.RuleIds).list_value().values(0).number_value());
+  EXPECT_EQ(5, request_fields.at(keys.AnomalyScore).number_value());
+  EXPECT_EQ(5, request_fields.at(keys.InspectedBytes).number_value());
+  EXPECT_EQ(1, request_fields.count(keys.TimeUs));
+  EXPECT_FALSE(request_fields.at(keys.Intervened).bool_value());
+
+  EXPECT_CALL(decoder_callbacks_.stream_info_, setDynamicMetadata("envoy.filters.http.modsecurity", _))
+      .WillOnce(SaveArg<1>(&metadata));
+  auto response_headers = responseHeaders();
+  EXPECT_EQ(FilterHeadersStatus::StopIteration, filter_->encodeHeaders(response_headers, false));
+  EXPECT_EQ(FilterDataStatus::Continue, encodeData("world!", true));
+  // Nothing ran since, not published again
+  filter_->onDestroy();
+  testing::Mock::VerifyAndClearExpectations(&decoder_callbacks_.stream_info_);
+
+  const auto& response_fields = metadata.fields();
+  EXPECT_EQ(11, response_fields.at(keys.InspectedBytes).number_value());
+  EXPECT_EQ(5, response_fields.at(keys.AnomalyScore).number_value());
+  EXPECT_FALSE(response_fields.at(keys.Intervened).bool_value());
+}
+
+TEST_F(HttpModSecurityFilterTest, DynamicMetadataOnIntervention) {
+  createFilter<true, true, true>();
+  const auto& keys = DynamicMetadataModSecurityKey::get();
+  ProtobufWkt::Struct metadata;
+  {
+    InSequence s;
+    EXPECT_CALL(decoder_callbacks_.stream_info_, setDynamicMetadata("envoy.filters.http.modsecurity", _))
+        .WillOnce(SaveArg<1>(&metadata));
+    expectLocalReply(1);
+  }
+  auto request_headers = requestHeaders("1");
+  EXPECT_EQ(FilterHeadersStatus::StopIteration, filter_->decodeHeaders(request_headers, false));
+  filter_->onDestroy();
+
+  const auto& fields = metadata.fields();
+  ASSERT_EQ(1, fields.at(keys.RuleIds).list_value().values_size());
+  EXPECT_EQ(1, fields.at(keys.RuleIds).list_value().values(0).number_value());
+  EXPECT_EQ(0, fields.at(keys.AnomalyScore).number_value());
+  EXPECT_EQ(0, fields.at(keys.InspectedBytes).number_value());
+  EXPECT_TRUE(fields.at(keys.Intervened).bool_value());
+}
+
+// Every phase's span is finished before the intervention's local reply is sent
+class HttpModSecurityFilterSpanTest : public HttpModSecurityFilterTest {
+public:
+  HttpModSecurityFilterSpanTest() {
+    ON_CALL(decoder_callbacks_, activeSpan()).WillByDefault(ReturnRef(active_span_));
+  }
+
+  TestRequestHeaderMapImpl tracedRequestHeaders(const std::string& block_phase = "",
+                                                const char* request_id = SampledRequestId) {
+    TestRequestHeaderMapImpl headers = requestHeaders(block_phase);
+    headers.addCopy("x-request-id", request_id);
+    return headers;
+  }
+
+  void expectPhaseBeforeLocalReply(int phase) {
+    InSequence s;
+    auto* child = new testing::NiceMock<Tracing::MockSpan>();
+    EXPECT_CALL(active_span_, spawnChild_(_, absl::StrCat("modsecurity phase ", phase), _)).WillOnce(Return(child));
+    EXPECT_CALL(*child, finishSpan());
+    EXPECT_CALL(decoder_callbacks_, sendLocalReply(Code::Forbidden, _, _, _, _));
+  }
+
+  testing::NiceMock<Tracing::MockSpan> active_span_;
+};
+
+TEST_F(HttpModSecurityFilterSpanTest, Phase1) {
+  createFilter<true, true, true>();
+  expectPhaseBeforeLocalReply(1);
+  auto request_headers = tracedRequestHeaders("1");
+  EXPECT_EQ(FilterHeadersStatus::StopIteration, filter_->decodeHeaders(request_headers, false));
+}
+
+TEST_F(HttpModSecurityFilterSpanTest, Phase2) {
+  EXPECT_CALL(active_span_, spawnChild_(_, "modsecurity phase 1", _))
+      .WillOnce(Return(new testing::NiceMock<Tracing::MockSpan>()));
+  createFilter<true, true, true>();
+  expectPhaseBeforeLocalReply(2);
+  auto request_headers = tracedRequestHeaders();
+  EXPECT_EQ(FilterHeadersStatus::StopIteration, filter_->decodeHeaders(request_headers, false));
+  EXPECT_EQ(FilterDataStatus::StopIterationNoBuffer, decodeData("an attack", true));
+}
+
+TEST_F(HttpModSecurityFilterSpanTest, Tags) {
+  createFilter<true, true, true>();
+  auto* child = new testing::NiceMock<Tracing::MockSpan>();
+  EXPECT_CALL(active_span_, spawnChild_(_, "modsecurity phase 1", _)).WillOnce(Return(child));
+  EXPECT_CALL(*child, setTag(Eq("modsecurity.phase"), Eq("1")));
+  EXPECT_CALL(*child, setTag(Eq("modsecurity.duration_us"), _));
+  EXPECT_CALL(*child, setTag(Eq("modsecurity.rule_ids"), Eq("6,1")));
+  EXPECT_CALL(*child, setTag(Eq("modsecurity.anomaly_score"), Eq("5")));
+  EXPECT_CALL(*child, setTag(Eq("modsecurity.intervention"), Eq("403")));
+  expectLocalReply(1);
+  auto request_headers = tracedRequestHeaders("1");
+  request_headers.addCopy("x-score", "1");
+  EXPECT_EQ(FilterHeadersStatus::StopIteration, filter_->decodeHeaders(request_headers, false));
+}
+
+// Unsampled streams get no span at all
+TEST_F(HttpModSecurityFilterSpanTest, NotSampled) {
+  createFilter<true, true, true>();
+  EXPECT_CALL(active_span_, spawnChild_(_, _, _)).Times(0);
+  auto request_headers = tracedRequestHeaders("", UnsampledRequestId);
+  EXPECT_EQ(FilterHeadersStatus::StopIteration, filter_->decodeHeaders(request_headers, false));
+  EXPECT_EQ(FilterDataStatus::Continue, decodeData("hello", true));
+  filter_->onDestroy();
+}
+
+// The shadow rules compare against the primary verdict, even when the filter doesn't act on it
+class HttpModSecurityFilterShadowTest : public HttpModSecurityFilterTest {
+public:
+  HttpModSecurityFilterShadowTest() : api_(Api::createApiForTest()) {
+    ON_CALL(context_, api()).WillByDefault(ReturnRef(*api_));
+    proto_config_.set_detection_only(true);
+    auto* shadow_rules = proto_config_.mutable_shadow_rules();
+    shadow_rules->add_rules_inline(Rules);
+    shadow_rules->set_sample_rate(1);
+    config_ = std::make_shared<HttpModSecurityFilterConfig>(proto_config_, context_);
+  }
+
+  ~HttpModSecurityFilterShadowTest() override {
+    // Joins the shadow thread before the api goes away
+    filter_.reset();
+    config_.reset();
+  }
+
+  // Evaluation runs on the shadow thread
+  void waitForEvaluated(uint64_t evaluated) {
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (config_->shadow_->stats().shadow_evaluated_.value() < evaluated &&
+           std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ASSERT_EQ(evaluated, config_->shadow_->stats().shadow_evaluated_.value());
+  }
+
+  Api::ApiPtr api_;
+};
+
+TEST_F(HttpModSecurityFilterShadowTest, DetectionOnlyAgreesOnBlock) {
+  createFilter<false, true, true>();
+  expectLocalReply(0);
+  auto request_headers = requestHeaders("1");
+  EXPECT_EQ(FilterHeadersStatus::Continue, filter_->decodeHeaders(request_headers, true));
+  waitForEvaluated(1);
+  EXPECT_EQ(1, config_->shadow_->stats().shadow_agree_.value());
+  EXPECT_EQ(0, config_->shadow_->stats().shadow_disagree_block_.value());
+  filter_->onDestroy();
+}
+
+TEST_F(HttpModSecurityFilterShadowTest, DetectionOnlyAgreesOnAllow) {
+  createFilter<false, true, true>();
+  auto request_headers = requestHeaders();
+  EXPECT_EQ(FilterHeadersStatus::Continue, filter_->decodeHeaders(request_headers, false));
+  EXPECT_EQ(FilterDataStatus::Continue, decodeData("hello", true));
+  waitForEvaluated(1);
+  EXPECT_EQ(1, config_->shadow_->stats().shadow_agree_.value());
+  EXPECT_EQ(0, config_->shadow_->stats().shadow_disagree_allow_.value());
+  filter_->onDestroy();
+}
+
+} // namespace
+} // namespace Http
+} // namespace Envoy
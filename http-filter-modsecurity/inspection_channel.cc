@@ -0,0 +1,230 @@
+#include "inspection_channel.h"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+namespace Envoy {
+namespace Http {
+
+void SpscRing::initialize(void* memory, uint64_t capacity) {
+    Header* header = new (memory) Header();
+    header->head.store(0, std::memory_order_relaxed);
+    header->tail.store(0, std::memory_order_relaxed);
+    header->producer_waiting.store(0, std::memory_order_relaxed);
+    header->capacity = capacity;
+}
+
+SpscRing::SpscRing(void* memory)
+    : header_(static_cast<Header*>(memory)),
+      data_(static_cast<uint8_t*>(memory) + sizeof(Header)), capacity_(header_->capacity), corrupted_(false) {
+}
+
+void SpscRing::reset() {
+    initialize(header_, capacity_);
+    corrupted_ = false;
+}
+
+bool SpscRing::push(InspectionMessage type, uint64_t stream_id, const void* data, size_t length) {
+    if (length > maxPayload()) {
+        return false;
+    }
+    const uint64_t capacity = capacity_;
+    const uint64_t size = recordSize(length);
+    uint64_t head = header_->head.load(std::memory_order_relaxed);
+    const uint64_t tail = header_->tail.load(std::memory_order_acquire);
+    // Also written by the consumer's process, only trusted when consistent
+    if (head - tail > capacity || head % sizeof(RecordHeader) != 0) {
+        return false;
+    }
+    uint64_t pos = head & (capacity - 1);
+    // Records never wrap, the end of the ring is skipped with a padding record
+    const uint64_t padding = (capacity - pos < size) ? capacity - pos : 0;
+    if (capacity - (head - tail) < padding + size) {
+        return false;
+    }
+    if (padding > 0) {
+        reinterpret_cast<RecordHeader*>(data_ + pos)->type = static_cast<uint32_t>(InspectionMessage::Padding);
+        head += padding;
+        pos = 0;
+    }
+    RecordHeader* record = reinterpret_cast<RecordHeader*>(data_ + pos);
+    record->type = static_cast<uint32_t>(type);
+    record->length = static_cast<uint32_t>(length);
+    record->stream_id = stream_id;
+    if (length > 0) {
+        memcpy(data_ + pos + sizeof(RecordHeader), data, length);
+    }
+    header_->head.store(head + size, std::memory_order_release);
+    return true;
+}
+
+void SpscRing::setProducerWaiting() {
+    header_->producer_waiting.store(1, std::memory_order_relaxed);
+    // Orders the flag before the producer reads tail again, pairs with takeProducerWaiting
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+bool SpscRing::takeProducerWaiting() {
+    // Orders the tail the consumer stored before reading the flag
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return header_->producer_waiting.load(std::memory_order_relaxed) != 0 &&
+           header_->producer_waiting.exchange(0, std::memory_order_relaxed) != 0;
+}
+
+InspectionChannel::InspectionChannel(int memfd, int request_fd, int verdict_fd, int space_fd, void* memory,
+                                     size_t size)
+    : memfd_(memfd), request_fd_(request_fd), verdict_fd_(verdict_fd), space_fd_(space_fd), memory_(memory),
+      size_(size), failed_(false) {
+    // Both rings have the same capacity, the second one starts right after the first
+    const uint64_t capacity = static_cast<SpscRing::Header*>(memory)->capacity;
+    requests_ = std::make_unique<SpscRing>(memory);
+    verdicts_ = std::make_unique<SpscRing>(static_cast<uint8_t*>(memory) + SpscRing::memorySize(capacity));
+}
+
+InspectionChannel::~InspectionChannel() {
+    munmap(memory_, size_);
+    close(memfd_);
+    close(request_fd_);
+    close(verdict_fd_);
+    close(space_fd_);
+}
+
+std::unique_ptr<InspectionChannel> InspectionChannel::create(uint64_t ring_bytes) {
+    uint64_t capacity = 4096;
+    while (capacity < ring_bytes) {
+        capacity <<= 1;
+    }
+    const size_t size = 2 * SpscRing::memorySize(capacity);
+
+    int memfd = memfd_create("modsecurity-inspection", MFD_CLOEXEC);
+    if (memfd == -1) {
+        return nullptr;
+    }
+    if (ftruncate(memfd, size) == -1) {
+        close(memfd);
+        return nullptr;
+    }
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (memory == MAP_FAILED) {
+        close(memfd);
+        return nullptr;
+    }
+    int request_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    int verdict_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    int space_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (request_fd == -1 || verdict_fd == -1 || space_fd == -1) {
+        munmap(memory, size);
+        close(memfd);
+        for (int fd : {request_fd, verdict_fd, space_fd}) {
+            if (fd != -1) {
+                close(fd);
+            }
+        }
+        return nullptr;
+    }
+    SpscRing::initialize(memory, capacity);
+    SpscRing::initialize(static_cast<uint8_t*>(memory) + SpscRing::memorySize(capacity), capacity);
+    return std::unique_ptr<InspectionChannel>(new InspectionChannel(memfd, request_fd, verdict_fd, space_fd, memory, size));
+}
+
+std::unique_ptr<InspectionChannel> InspectionChannel::attach(const std::string& descriptor) {
+    int memfd, request_fd, verdict_fd, space_fd;
+    if (sscanf(descriptor.c_str(), "%d:%d:%d:%d", &memfd, &request_fd, &verdict_fd, &space_fd) != 4) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    const off_t size = lseek(memfd, 0, SEEK_END);
+    if (size <= 0) {
+        return nullptr;
+    }
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+    return std::unique_ptr<InspectionChannel>(
+        new InspectionChannel(memfd, request_fd, verdict_fd, space_fd, memory, size));
+}
+
+std::string InspectionChannel::descriptor() const {
+    return std::to_string(memfd_) + ":" + std::to_string(request_fd_) + ":" + std::to_string(verdict_fd_) + ":" +
+           std::to_string(space_fd_);
+}
+
+void InspectionChannel::reset() {
+    requests_->reset();
+    verdicts_->reset();
+    for (int fd : {request_fd_, verdict_fd_, space_fd_}) {
+        clear(fd);
+    }
+    failed_.store(false, std::memory_order_release);
+}
+
+bool InspectionChannel::pushVerdict(uint64_t stream_id, const void* data, size_t length, int timeout_ms) {
+    if (verdicts_->push(InspectionMessage::Verdict, stream_id, data, length)) {
+        return true;
+    }
+    while (true) {
+        // Checked once more after raising the flag, the worker may have drained before seeing it
+        verdicts_->setProducerWaiting();
+        if (verdicts_->push(InspectionMessage::Verdict, stream_id, data, length)) {
+            return true;
+        }
+        // The worker may not have been woken up for the verdicts already in the ring
+        signal(verdict_fd_);
+        struct pollfd pfd = {space_fd_, POLLIN, 0};
+        // Timed out or interrupted, the caller checks whether it is terminating before trying again
+        if (poll(&pfd, 1, timeout_ms) <= 0) {
+            return false;
+        }
+        clear(space_fd_);
+    }
+}
+
+void InspectionChannel::signal(int fd) {
+    const uint64_t one = 1;
+    // EAGAIN means the counter is saturated, the consumer is awake anyway
+    while (write(fd, &one, sizeof(one)) == -1 && errno == EINTR) {
+    }
+}
+
+void InspectionChannel::clear(int fd) {
+    uint64_t value;
+    while (read(fd, &value, sizeof(value)) == -1 && errno == EINTR) {
+    }
+}
+
+std::string encodeInspectionFields(const std::vector<std::string>& fields) {
+    std::string message;
+    for (size_t i = 0; i < fields.size(); i++) {
+        if (i > 0) {
+            message.push_back('\0');
+        }
+        message.append(fields[i]);
+    }
+    return message;
+}
+
+std::vector<std::string> decodeInspectionFields(const void* data, size_t length) {
+    std::vector<std::string> fields;
+    const char* begin = static_cast<const char*>(data);
+    const char* end = begin + length;
+    while (true) {
+        const char* separator = static_cast<const char*>(memchr(begin, '\0', end - begin));
+        if (separator == nullptr) {
+            fields.emplace_back(begin, end);
+            return fields;
+        }
+        fields.emplace_back(begin, separator);
+        begin = separator + 1;
+    }
+}
+
+} // namespace Http
+} // namespace Envoy
@@ -0,0 +1,285 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Note - this file is shared with the inspection engine binary, keep it free of envoy dependencies.
+
+namespace Envoy {
+namespace Http {
+
+/**
+ * Messages exchanged between the filter and the inspection engine.
+ * Fields of a message are separated by '\0', bodies are sent as is.
+ */
+enum class InspectionMessage : uint32_t {
+  // Fills the end of the ring when a record doesn't fit before wrapping
+  Padding = 0,
+  // client_ip, client_port, server_ip, server_port, no_audit_log
+  Connection,
+  // uri, method, protocol
+  Uri,
+  // key, value
+  RequestHeader,
+  // end_stream. Answered by a Verdict
+  RequestHeadersDone,
+  // raw body slice
+  RequestBody,
+  // Answered by a Verdict
+  RequestBodyDone,
+  // key, value
+  ResponseHeader,
+  // code, protocol, end_stream. Answered by a Verdict
+  ResponseHeadersDone,
+  // raw body slice
+  ResponseBody,
+  // Answered by a Verdict
+  ResponseBodyDone,
+  // Stream is destroyed, the engine runs the logging phase and forgets the stream
+  Close,
+  // checkpoint, status, disruptive. Sent by the engine for each *Done message,
+  // and as soon as a transaction becomes disruptive
+  Verdict,
+};
+
+/**
+ * Single producer single consumer ring of variable length records, living in shared memory.
+ * Producer and consumer may be different processes, they only share the memory.
+ */
+class SpscRing {
+public:
+  struct Header {
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    // Set by a producer waiting for space, see InspectionChannel::pushVerdict
+    std::atomic<uint32_t> producer_waiting;
+    alignas(64) uint64_t capacity;
+  };
+
+  /**
+   * @return bytes of shared memory needed by a ring of the given capacity
+   */
+  static size_t memorySize(uint64_t capacity) { return sizeof(Header) + capacity; }
+
+  /**
+   * Initializes an empty ring in memory. Capacity must be a power of 2.
+   */
+  static void initialize(void* memory, uint64_t capacity);
+
+  explicit SpscRing(void* memory);
+
+  /**
+   * Producer side. The record is written as a whole or not at all.
+   * @return false if there is not enough free space
+   */
+  bool push(InspectionMessage type, uint64_t stream_id, const void* data, size_t length);
+
+  /**
+   * Consumer side. Invokes cb(type, stream_id, data, length) for every available record,
+   * data is only valid for the duration of the callback.
+   * The other process may be broken: a record that doesn't fit between tail and head, or in the ring,
+   * marks the ring corrupted and stops the drain, see corrupted().
+   * @return number of records consumed
+   */
+  template <class Callback> size_t drain(Callback cb) {
+    size_t consumed = 0;
+    if (corrupted_) {
+      return consumed;
+    }
+    uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+    uint64_t head;
+    while ((head = header_->head.load(std::memory_order_acquire)) != tail) {
+      const uint64_t available = head - tail;
+      if (available > capacity_ || available % sizeof(RecordHeader) != 0 || tail % sizeof(RecordHeader) != 0) {
+        corrupted_ = true;
+        return consumed;
+      }
+      const uint64_t pos = tail & (capacity_ - 1);
+      // Copied once, the producer could change it while it is checked
+      RecordHeader record;
+      memcpy(&record, data_ + pos, sizeof(record));
+      uint64_t size;
+      if (record.type == static_cast<uint32_t>(InspectionMessage::Padding)) {
+        size = capacity_ - pos;
+      } else if (record.length <= maxPayload()) {
+        size = recordSize(record.length);
+      } else {
+        size = UINT64_MAX;
+      }
+      if (size > available || size > capacity_ - pos) {
+        corrupted_ = true;
+        return consumed;
+      }
+      if (record.type != static_cast<uint32_t>(InspectionMessage::Padding)) {
+        cb(static_cast<InspectionMessage>(record.type), record.stream_id, data_ + pos + sizeof(RecordHeader),
+           record.length);
+        consumed++;
+      }
+      tail += size;
+      header_->tail.store(tail, std::memory_order_release);
+    }
+    return consumed;
+  }
+
+  /**
+   * @return true if drain() found a record it couldn't trust, nothing is consumed anymore until reset()
+   */
+  bool corrupted() const { return corrupted_; }
+
+  /**
+   * Empties the ring. Neither side may use it concurrently.
+   */
+  void reset();
+
+  /**
+   * @return largest payload a single record can hold
+   */
+  size_t maxPayload() const { return capacity_ / 2 - sizeof(RecordHeader); }
+
+  /**
+   * Producer side, to be called before checking one last time for space and going to sleep.
+   */
+  void setProducerWaiting();
+  /**
+   * Consumer side, to be called after draining.
+   * @return true if the producer was waiting for space, and must be woken up
+   */
+  bool takeProducerWaiting();
+
+  /**
+   * @return positions of the producer and the consumer, for the liveness check of the consumer
+   */
+  uint64_t head() const { return header_->head.load(std::memory_order_acquire); }
+  uint64_t tail() const { return header_->tail.load(std::memory_order_acquire); }
+
+private:
+  struct RecordHeader {
+    uint32_t type;
+    uint32_t length;
+    uint64_t stream_id;
+  };
+
+  static uint64_t recordSize(size_t length) {
+    return (sizeof(RecordHeader) + length + sizeof(RecordHeader) - 1) & ~(sizeof(RecordHeader) - 1);
+  }
+
+  Header* header_;
+  uint8_t* data_;
+  // Read once, the shared header is writable by the other process
+  const uint64_t capacity_;
+  bool corrupted_;
+};
+
+/**
+ * A pair of rings between one envoy worker and an inspection engine:
+ * requests flow from the worker to the engine, verdicts flow back.
+ * Each direction has an eventfd the producer writes to in order to wake the consumer,
+ * and a third one wakes the engine once the worker made room in a full verdict ring.
+ */
+class InspectionChannel {
+public:
+  /**
+   * Allocates the shared memory and eventfds. The descriptors are close-on-exec,
+   * the supervisor clears the flag in the engine process only.
+   * @return nullptr on failure, errno is set
+   */
+  static std::unique_ptr<InspectionChannel> create(uint64_t ring_bytes);
+
+  /**
+   * Maps a channel created by another process, see descriptor().
+   * @return nullptr on failure
+   */
+  static std::unique_ptr<InspectionChannel> attach(const std::string& descriptor);
+
+  ~InspectionChannel();
+
+  /**
+   * @return the channel's descriptors formatted as "memfd:request_eventfd:verdict_eventfd:space_eventfd"
+   */
+  std::string descriptor() const;
+  std::vector<int> fds() const { return {memfd_, request_fd_, verdict_fd_, space_fd_}; }
+
+  SpscRing& requests() { return *requests_; }
+  SpscRing& verdicts() { return *verdicts_; }
+  int requestFd() const { return request_fd_; }
+  int verdictFd() const { return verdict_fd_; }
+
+  /**
+   * Engine side. Pushes a verdict, sleeping on the space eventfd while the ring is full.
+   * @return false if the ring was still full after timeout_ms
+   */
+  bool pushVerdict(uint64_t stream_id, const void* data, size_t length, int timeout_ms);
+
+  /**
+   * Worker side. Drains the verdict ring, see SpscRing::drain, and wakes the engine if it waits for space.
+   */
+  template <class Callback> size_t drainVerdicts(Callback cb) {
+    if (failed()) {
+      return 0;
+    }
+    const size_t consumed = verdicts_->drain(cb);
+    if (verdicts_->corrupted()) {
+      failed_.store(true, std::memory_order_release);
+      return consumed;
+    }
+    if (verdicts_->takeProducerWaiting()) {
+      signal(space_fd_);
+    }
+    return consumed;
+  }
+
+  /**
+   * @return true once the engine wrote a corrupted verdict ring. The worker then leaves both rings alone,
+   * and the supervisor kills the engine and resets the channel before starting the next one.
+   */
+  bool failed() const { return failed_.load(std::memory_order_acquire); }
+
+  /**
+   * Supervisor side. Empties both rings and the eventfds of a failed channel whose engine is dead,
+   * and hands the channel back to the worker.
+   */
+  void reset();
+
+  /**
+   * Wakes the consumer waiting on fd
+   */
+  static void signal(int fd);
+  /**
+   * Resets the wakeup counter of fd, to be called before draining
+   */
+  static void clear(int fd);
+
+private:
+  InspectionChannel(int memfd, int request_fd, int verdict_fd, int space_fd, void* memory, size_t size);
+
+  const int memfd_;
+  const int request_fd_;
+  const int verdict_fd_;
+  const int space_fd_;
+  void* const memory_;
+  const size_t size_;
+  std::unique_ptr<SpscRing> requests_;
+  std::unique_ptr<SpscRing> verdicts_;
+  std::atomic<bool> failed_;
+};
+
+typedef std::unique_ptr<InspectionChannel> InspectionChannelPtr;
+typedef std::shared_ptr<InspectionChannel> InspectionChannelSharedPtr;
+
+/**
+ * Joins fields of a message with '\0'
+ */
+std::string encodeInspectionFields(const std::vector<std::string>& fields);
+
+/**
+ * Splits a message into its '\0' separated fields
+ */
+std::vector<std::string> decodeInspectionFields(const void* data, size_t length);
+
+} // namespace Http
+} // namespace Envoy
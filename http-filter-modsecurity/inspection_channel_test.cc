@@ -0,0 +1,311 @@
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "inspection_channel.h"
+
+#include "gtest/gtest.h"
+
+namespace Envoy {
+namespace Http {
+namespace {
+
+struct Record {
+  InspectionMessage type;
+  uint64_t stream_id;
+  std::string data;
+};
+
+std::vector<Record> drain(SpscRing& ring) {
+  std::vector<Record> records;
+  ring.drain([&records](InspectionMessage type, uint64_t stream_id, const uint8_t* data, size_t length) {
+    records.push_back({type, stream_id, std::string(reinterpret_cast<const char*>(data), length)});
+  });
+  return records;
+}
+
+bool push(SpscRing& ring, uint64_t stream_id, const std::string& data) {
+  return ring.push(InspectionMessage::RequestBody, stream_id, data.data(), data.size());
+}
+
+class InspectionChannelTest : public testing::Test {
+public:
+  InspectionChannelTest() : channel_(InspectionChannel::create(4096)) {}
+
+  InspectionChannelPtr channel_;
+};
+
+TEST_F(InspectionChannelTest, PushDrain) {
+  ASSERT_NE(nullptr, channel_);
+  SpscRing& ring = channel_->requests();
+  EXPECT_TRUE(ring.push(InspectionMessage::Close, 1, nullptr, 0));
+  EXPECT_TRUE(push(ring, 2, "body"));
+  EXPECT_TRUE(push(ring, 3, std::string("a\0b", 3)));
+
+  auto records = drain(ring);
+  ASSERT_EQ(3, records.size());
+  EXPECT_EQ(InspectionMessage::Close, records[0].type);
+  EXPECT_EQ(1, records[0].stream_id);
+  EXPECT_EQ("", records[0].data);
+  EXPECT_EQ(InspectionMessage::RequestBody, records[1].type);
+  EXPECT_EQ(2, records[1].stream_id);
+  EXPECT_EQ("body", records[1].data);
+  EXPECT_EQ(std::string("a\0b", 3), records[2].data);
+  EXPECT_TRUE(drain(ring).empty());
+  EXPECT_EQ(ring.head(), ring.tail());
+}
+
+// Records never wrap, the padding written in front of the wrap point is skipped by the consumer
+TEST_F(InspectionChannelTest, WrapAroundWithPadding) {
+  ASSERT_NE(nullptr, channel_);
+  SpscRing& ring = channel_->requests();
+  uint64_t pushed = 0;
+  uint64_t drained = 0;
+  // Sizes that don't divide the capacity, so the ring wraps at a different offset every turn
+  for (int i = 0; i < 200; i++) {
+    const std::string data(100 + (i * 37) % 900, static_cast<char>('a' + i % 26));
+    ASSERT_TRUE(push(ring, pushed++, data)) << i;
+    if (i % 3 == 2) {
+      for (const Record& record : drain(ring)) {
+        EXPECT_EQ(InspectionMessage::RequestBody, record.type);
+        EXPECT_EQ(drained, record.stream_id);
+        EXPECT_EQ(std::string(100 + (drained * 37) % 900, static_cast<char>('a' + drained % 26)), record.data);
+        drained++;
+      }
+    }
+  }
+  drained += drain(ring).size();
+  EXPECT_EQ(pushed, drained);
+  // Several times around the ring
+  EXPECT_GT(ring.head(), 4 * 4096);
+}
+
+TEST_F(InspectionChannelTest, FullRing) {
+  ASSERT_NE(nullptr, channel_);
+  SpscRing& ring = channel_->requests();
+  const std::string data(1000, 'x');
+  int pushed = 0;
+  while (push(ring, pushed, data)) {
+    pushed++;
+  }
+  // 1024 bytes per record with its header and alignment
+  EXPECT_EQ(4, pushed);
+  // Nothing was overwritten by the failed push
+  auto records = drain(ring);
+  ASSERT_EQ(4, records.size());
+  for (int i = 0; i < 4; i++) {
+    EXPECT_EQ(i, records[i].stream_id);
+    EXPECT_EQ(data, records[i].data);
+  }
+  EXPECT_TRUE(push(ring, 4, data));
+}
+
+// A record needing padding doesn't fit when the padding and the record exceed the free space,
+// even if the record alone would fit
+TEST_F(InspectionChannelTest, FullRingWithPadding) {
+  ASSERT_NE(nullptr, channel_);
+  SpscRing& ring = channel_->requests();
+  // Records of 1024, 2048, 768 and 1040 bytes with their header
+  ASSERT_TRUE(push(ring, 1, std::string(1008, 'a')));
+  ASSERT_EQ(1, drain(ring).size());
+  ASSERT_TRUE(push(ring, 2, std::string(2032, 'b')));
+  ASSERT_TRUE(push(ring, 3, std::string(752, 'c')));
+  // 1280 bytes free, 256 of them at the end of the ring
+  const std::string data(1024, 'd');
+  EXPECT_FALSE(push(ring, 4, data));
+  ASSERT_EQ(2, drain(ring).size());
+  EXPECT_TRUE(push(ring, 4, data));
+  auto records = drain(ring);
+  ASSERT_EQ(1, records.size());
+  EXPECT_EQ(4, records[0].stream_id);
+  EXPECT_EQ(data, records[0].data);
+  EXPECT_EQ(4096 + 1040, ring.head());
+}
+
+TEST_F(InspectionChannelTest, MaxPayload) {
+  ASSERT_NE(nullptr, channel_);
+  SpscRing& ring = channel_->requests();
+  EXPECT_EQ(2048 - 16, ring.maxPayload());
+  EXPECT_FALSE(push(ring, 1, std::string(ring.maxPayload() + 1, 'x')));
+  EXPECT_TRUE(push(ring, 1, std::string(ring.maxPayload(), 'x')));
+  EXPECT_EQ(1, drain(ring).size());
+}
+
+TEST_F(InspectionChannelTest, Attach) {
+  ASSERT_NE(nullptr, channel_);
+  // As the engine does after inheriting the descriptors, on duplicates since both ends close theirs
+  std::string descriptor;
+  for (int fd : channel_->fds()) {
+    descriptor += (descriptor.empty() ? "" : ":") + std::to_string(dup(fd));
+  }
+  InspectionChannelPtr attached = InspectionChannel::attach(descriptor);
+  ASSERT_NE(nullptr, attached);
+  EXPECT_EQ(4, attached->fds().size());
+
+  ASSERT_TRUE(push(channel_->requests(), 7, "request"));
+  auto records = drain(attached->requests());
+  ASSERT_EQ(1, records.size());
+  EXPECT_EQ("request", records[0].data);
+
+  const std::string verdict = encodeInspectionFields({"4", "403", "1"});
+  ASSERT_TRUE(attached->pushVerdict(7, verdict.data(), verdict.size(), 0));
+  records = drain(channel_->verdicts());
+  ASSERT_EQ(1, records.size());
+  EXPECT_EQ(InspectionMessage::Verdict, records[0].type);
+  EXPECT_EQ(verdict, records[0].data);
+}
+
+TEST_F(InspectionChannelTest, AttachMalformed) {
+  EXPECT_EQ(nullptr, InspectionChannel::attach("1:2:3"));
+  EXPECT_EQ(nullptr, InspectionChannel::attach("memfd"));
+}
+
+TEST_F(InspectionChannelTest, PushVerdictTimesOut) {
+  ASSERT_NE(nullptr, channel_);
+  const std::string verdict(1000, 'v');
+  while (channel_->pushVerdict(1, verdict.data(), verdict.size(), 0)) {
+  }
+  const auto start = std::chrono::steady_clock::now();
+  EXPECT_FALSE(channel_->pushVerdict(1, verdict.data(), verdict.size(), 20));
+  EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(20));
+}
+
+// The engine sleeps on the space eventfd until the worker drains the verdict ring
+TEST_F(InspectionChannelTest, PushVerdictWaitsForDrain) {
+  ASSERT_NE(nullptr, channel_);
+  const std::string verdict(1000, 'v');
+  int pushed = 0;
+  while (channel_->pushVerdict(pushed, verdict.data(), verdict.size(), 0)) {
+    pushed++;
+  }
+
+  std::vector<uint64_t> drained;
+  std::thread worker([this, &drained]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    channel_->drainVerdicts([&drained](InspectionMessage, uint64_t stream_id, const uint8_t*, size_t) {
+      drained.push_back(stream_id);
+    });
+  });
+  EXPECT_TRUE(channel_->pushVerdict(pushed, verdict.data(), verdict.size(), 10000));
+  worker.join();
+  EXPECT_EQ(pushed, drained.size());
+
+  auto records = drain(channel_->verdicts());
+  ASSERT_EQ(1, records.size());
+  EXPECT_EQ(pushed, records[0].stream_id);
+}
+
+// A ring written by a broken process is never read out of bounds
+class CorruptedRingTest : public testing::Test {
+public:
+  CorruptedRingTest() : memory_(SpscRing::memorySize(4096)) {
+    SpscRing::initialize(memory_.data(), 4096);
+    ring_ = std::make_unique<SpscRing>(memory_.data());
+  }
+
+  SpscRing::Header& header() { return *reinterpret_cast<SpscRing::Header*>(memory_.data()); }
+  // The length field of the record at pos
+  uint32_t& length(uint64_t pos) {
+    return *reinterpret_cast<uint32_t*>(memory_.data() + sizeof(SpscRing::Header) + pos + sizeof(uint32_t));
+  }
+
+  std::vector<uint8_t> memory_;
+  std::unique_ptr<SpscRing> ring_;
+};
+
+TEST_F(CorruptedRingTest, LengthPastHead) {
+  ASSERT_TRUE(push(*ring_, 1, "first"));
+  ASSERT_TRUE(push(*ring_, 2, "second"));
+  length(0) = 100;
+  EXPECT_TRUE(drain(*ring_).empty());
+  EXPECT_TRUE(ring_->corrupted());
+  // Nothing is consumed anymore, even once the record looks fine again
+  length(0) = 5;
+  EXPECT_TRUE(drain(*ring_).empty());
+  EXPECT_EQ(0, ring_->tail());
+}
+
+TEST_F(CorruptedRingTest, LengthPastCapacity) {
+  ASSERT_TRUE(push(*ring_, 1, "first"));
+  length(0) = 0xffffffff;
+  header().head.store(4096);
+  EXPECT_TRUE(drain(*ring_).empty());
+  EXPECT_TRUE(ring_->corrupted());
+}
+
+TEST_F(CorruptedRingTest, HeadPastCapacity) {
+  ASSERT_TRUE(push(*ring_, 1, "first"));
+  header().head.store(4096 + 16);
+  EXPECT_TRUE(drain(*ring_).empty());
+  EXPECT_TRUE(ring_->corrupted());
+}
+
+TEST_F(CorruptedRingTest, UnalignedHead) {
+  ASSERT_TRUE(push(*ring_, 1, "first"));
+  header().head.store(header().head.load() + 3);
+  EXPECT_TRUE(drain(*ring_).empty());
+  EXPECT_TRUE(ring_->corrupted());
+  // The producer doesn't write past it either
+  EXPECT_FALSE(push(*ring_, 2, "second"));
+}
+
+// The capacity is read once, a shared header rewritten later isn't trusted
+TEST_F(CorruptedRingTest, CapacityRewritten) {
+  header().capacity = 1 << 30;
+  EXPECT_EQ(2048 - 16, ring_->maxPayload());
+  EXPECT_FALSE(push(*ring_, 1, std::string(4000, 'x')));
+}
+
+TEST_F(CorruptedRingTest, Reset) {
+  ASSERT_TRUE(push(*ring_, 1, "first"));
+  length(0) = 100;
+  EXPECT_TRUE(drain(*ring_).empty());
+  ring_->reset();
+  EXPECT_FALSE(ring_->corrupted());
+  EXPECT_EQ(0, ring_->head());
+  ASSERT_TRUE(push(*ring_, 2, "second"));
+  EXPECT_EQ(1, drain(*ring_).size());
+}
+
+// The worker leaves a channel with a corrupted verdict ring alone until the supervisor resets it
+TEST_F(InspectionChannelTest, FailsOnCorruptedVerdicts) {
+  ASSERT_NE(nullptr, channel_);
+  ASSERT_TRUE(channel_->pushVerdict(1, "v", 1, 0));
+  const size_t size = 2 * SpscRing::memorySize(4096);
+  void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, channel_->fds()[0], 0);
+  ASSERT_NE(MAP_FAILED, memory);
+  // Length of the first verdict record
+  uint8_t* verdicts = static_cast<uint8_t*>(memory) + SpscRing::memorySize(4096);
+  *reinterpret_cast<uint32_t*>(verdicts + sizeof(SpscRing::Header) + sizeof(uint32_t)) = 1 << 20;
+
+  int drained = 0;
+  auto count = [&drained](InspectionMessage, uint64_t, const uint8_t*, size_t) { drained++; };
+  EXPECT_EQ(0, channel_->drainVerdicts(count));
+  EXPECT_TRUE(channel_->failed());
+  *reinterpret_cast<uint32_t*>(verdicts + sizeof(SpscRing::Header) + sizeof(uint32_t)) = 1;
+  EXPECT_EQ(0, channel_->drainVerdicts(count));
+
+  channel_->reset();
+  EXPECT_FALSE(channel_->failed());
+  ASSERT_TRUE(channel_->pushVerdict(2, "v", 1, 0));
+  EXPECT_EQ(1, channel_->drainVerdicts(count));
+  EXPECT_EQ(1, drained);
+  munmap(memory, size);
+}
+
+TEST(InspectionFieldsTest, EncodeDecode) {
+  const std::vector<std::string> fields = {"127.0.0.1", "", "80", "a b"};
+  const std::string message = encodeInspectionFields(fields);
+  EXPECT_EQ(std::string("127.0.0.1\0\0" "80\0a b", 17), message);
+  EXPECT_EQ(fields, decodeInspectionFields(message.data(), message.size()));
+  EXPECT_EQ(std::vector<std::string>{""}, decodeInspectionFields("", 0));
+}
+
+} // namespace
+} // namespace Http
+} // namespace Envoy
@@ -0,0 +1,405 @@
+/**
+ * Out of process ModSecurity inspection engine.
+ *
+ * Started and supervised by the filter when inspection_engine is configured. Loads the same rules as the filter,
+ * consumes transactions from the channels it was handed over and answers with verdicts, see inspection_channel.h.
+ *
+ * Usage: modsec_inspection_engine --rules_fd fd [--cpu n] --channel memfd:request_fd:verdict_fd:space_fd...
+ *
+ * The rules configuration is read from the inherited rules_fd rather than the command line, which any local user
+ * can read and whose size is limited. It holds '\0' separated fields, in loading order:
+ * rules_path <path>, rules_inline <rules>, remote <key> <url> and remotes_overwrite_on_success.
+ */
+#include <sched.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "inspection_channel.h"
+
+#include "modsecurity/audit_log.h"
+#include "modsecurity/modsecurity.h"
+#include "modsecurity/rule_message.h"
+#include "modsecurity/rules.h"
+#include "modsecurity/transaction.h"
+
+namespace Envoy {
+namespace Http {
+namespace {
+
+volatile sig_atomic_t terminate_ = 0;
+
+// How long a full verdict ring is waited for before checking for termination
+constexpr int VerdictWaitMs = 100;
+
+void onTerminate(int) {
+    terminate_ = 1;
+}
+
+void logCb(void* data, const void* ruleMessagev) {
+    auto ruleMessage = reinterpret_cast<const modsecurity::RuleMessage *>(ruleMessagev);
+    if (ruleMessage == nullptr) {
+        return;
+    }
+    std::cerr << "[modsecurity-engine " << getpid() << "] " << modsecurity::RuleMessage::log(ruleMessage) << std::endl;
+}
+
+struct EngineOptions {
+    std::vector<std::string> rules_path;
+    std::vector<std::string> rules_inline;
+    std::vector<std::pair<std::string, std::string>> remotes;
+    bool remotes_overwrite_on_success = false;
+    int cpu = -1;
+    std::vector<std::string> channels;
+};
+
+/**
+ * A transaction of one stream, driven by the messages of a channel
+ */
+struct EngineTransaction {
+    std::unique_ptr<modsecurity::Transaction> transaction;
+    bool no_audit_log = false;
+    bool logged = false;
+    // Once disruptive, the verdict was sent and further messages (but Close) are ignored
+    bool intervened = false;
+};
+
+class Engine {
+public:
+    Engine(modsecurity::ModSecurity& modsec, modsecurity::Rules& rules) : modsec_(modsec), rules_(rules) {}
+
+    /**
+     * Consumes all pending requests of a channel, and wakes the worker if verdicts were produced
+     */
+    void process(InspectionChannel& channel) {
+        auto& transactions = transactions_[&channel];
+        bool verdicts = false;
+        channel.requests().drain([&](InspectionMessage type, uint64_t stream_id, const uint8_t* data, size_t length) {
+            verdicts |= onMessage(channel, transactions, type, stream_id, data, length);
+        });
+        if (verdicts) {
+            InspectionChannel::signal(channel.verdictFd());
+        }
+        if (channel.requests().corrupted()) {
+            // Restarted by the supervisor
+            std::cerr << "Corrupted request ring, exiting" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+    }
+
+private:
+    typedef std::unordered_map<uint64_t, EngineTransaction> Transactions;
+
+    /**
+     * @return true if a verdict was sent
+     */
+    bool onMessage(InspectionChannel& channel, Transactions& transactions, InspectionMessage type,
+                   uint64_t stream_id, const uint8_t* data, size_t length) {
+        if (type == InspectionMessage::Connection) {
+            auto fields = decodeInspectionFields(data, length);
+            if (fields.size() != 5) {
+                return false;
+            }
+            EngineTransaction& tx = transactions[stream_id];
+            tx.transaction.reset(new modsecurity::Transaction(&modsec_, &rules_, nullptr));
+            tx.no_audit_log = fields[4] == "1";
+            tx.transaction->processConnection(fields[0].c_str(), std::atoi(fields[1].c_str()),
+                                              fields[2].c_str(), std::atoi(fields[3].c_str()));
+            return checkIntervention(channel, stream_id, tx, type);
+        }
+
+        auto it = transactions.find(stream_id);
+        if (it == transactions.end()) {
+            // Stream started before a restart of this engine, the filter times out on it
+            return false;
+        }
+        EngineTransaction& tx = it->second;
+        if (type == InspectionMessage::Close) {
+            tx.transaction->processLogging();
+            transactions.erase(it);
+            return false;
+        }
+        if (tx.intervened) {
+            return false;
+        }
+
+        modsecurity::Transaction& transaction = *tx.transaction;
+        switch (type) {
+        case InspectionMessage::Uri: {
+            auto fields = decodeInspectionFields(data, length);
+            if (fields.size() == 3) {
+                transaction.processURI(fields[0].c_str(), fields[1].c_str(), fields[2].c_str());
+            }
+            return checkIntervention(channel, stream_id, tx, type);
+        }
+        case InspectionMessage::RequestHeader: {
+            auto fields = decodeInspectionFields(data, length);
+            if (fields.size() == 2) {
+                transaction.addRequestHeader(fields[0].c_str(), fields[1].c_str());
+            }
+            return false;
+        }
+        case InspectionMessage::RequestHeadersDone:
+            transaction.processRequestHeaders();
+            return sendVerdict(channel, stream_id, tx, type);
+        case InspectionMessage::RequestBody:
+            transaction.appendRequestBody(data, length);
+            return checkIntervention(channel, stream_id, tx, type);
+        case InspectionMessage::RequestBodyDone:
+            transaction.processRequestBody();
+            return sendVerdict(channel, stream_id, tx, type);
+        case InspectionMessage::ResponseHeader: {
+            auto fields = decodeInspectionFields(data, length);
+            if (fields.size() == 2) {
+                transaction.addResponseHeader(fields[0].c_str(), fields[1].c_str());
+            }
+            return false;
+        }
+        case InspectionMessage::ResponseHeadersDone: {
+            auto fields = decodeInspectionFields(data, length);
+            if (fields.size() == 3) {
+                transaction.processResponseHeaders(std::atoi(fields[0].c_str()), fields[1].c_str());
+            }
+            return sendVerdict(channel, stream_id, tx, type);
+        }
+        case InspectionMessage::ResponseBody:
+            transaction.appendResponseBody(data, length);
+            return checkIntervention(channel, stream_id, tx, type);
+        case InspectionMessage::ResponseBodyDone:
+            transaction.processResponseBody();
+            return sendVerdict(channel, stream_id, tx, type);
+        default:
+            return false;
+        }
+    }
+
+    /**
+     * Sends a verdict only if the transaction became disruptive
+     */
+    bool checkIntervention(InspectionChannel& channel, uint64_t stream_id, EngineTransaction& tx,
+                           InspectionMessage checkpoint) {
+        if (!tx.transaction->m_it.disruptive) {
+            auditLog(tx);
+            return false;
+        }
+        return sendVerdict(channel, stream_id, tx, checkpoint);
+    }
+
+    bool sendVerdict(InspectionChannel& channel, uint64_t stream_id, EngineTransaction& tx,
+                     InspectionMessage checkpoint) {
+        auditLog(tx);
+        modsecurity::Transaction& transaction = *tx.transaction;
+        tx.intervened = transaction.m_it.disruptive;
+        const std::string verdict = encodeInspectionFields({
+            std::to_string(static_cast<uint32_t>(checkpoint)),
+            std::to_string(transaction.m_it.status),
+            transaction.m_it.disruptive ? "1" : "0"});
+        // The worker drains verdicts on its event loop, sleep until it made room
+        while (!terminate_ && !channel.pushVerdict(stream_id, verdict.data(), verdict.size(), VerdictWaitMs)) {
+        }
+        return true;
+    }
+
+    /**
+     * Same audit log as the in-process filter, written to the inherited stderr
+     */
+    void auditLog(EngineTransaction& tx) {
+        modsecurity::Transaction& transaction = *tx.transaction;
+        if (tx.logged || tx.no_audit_log || (transaction.m_it.status == 200 && !transaction.m_it.disruptive)) {
+            return;
+        }
+        tx.logged = true;
+        int parts = transaction.m_rules->m_auditLog->getParts();
+        if (transaction.m_rules->m_auditLog->m_format == modsecurity::audit_log::AuditLog::JSONAuditLogFormat) {
+            std::cerr << transaction.toJSON(parts) << std::endl;
+        } else {
+            std::cerr << transaction.toOldAuditLogFormat(parts, "-" + std::to_string(getpid()) + "--") << std::endl;
+        }
+    }
+
+    modsecurity::ModSecurity& modsec_;
+    modsecurity::Rules& rules_;
+    std::unordered_map<InspectionChannel*, Transactions> transactions_;
+};
+
+bool parseOptions(int argc, char** argv, EngineOptions& options, int& rules_fd) {
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        } else if (arg == "--rules_fd") {
+            rules_fd = std::atoi(argv[++i]);
+        } else if (arg == "--cpu") {
+            options.cpu = std::atoi(argv[++i]);
+        } else if (arg == "--channel") {
+            options.channels.push_back(argv[++i]);
+        } else {
+            return false;
+        }
+    }
+    return rules_fd >= 0 && !options.channels.empty();
+}
+
+/**
+ * Reads the rules configuration written by the supervisor, see the usage above
+ */
+bool readRulesConfig(int fd, EngineOptions& options) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return false;
+    }
+    std::string data(st.st_size, '\0');
+    // The file offset is shared with the supervisor and the other engines
+    off_t offset = 0;
+    while (offset < st.st_size) {
+        const ssize_t rc = pread(fd, &data[offset], st.st_size - offset, offset);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rc <= 0) {
+            return false;
+        }
+        offset += rc;
+    }
+    close(fd);
+    if (data.empty()) {
+        return true;
+    }
+    const auto fields = decodeInspectionFields(data.data(), data.size());
+    for (size_t i = 0; i < fields.size(); i++) {
+        if (fields[i] == "remotes_overwrite_on_success") {
+            options.remotes_overwrite_on_success = true;
+        } else if (fields[i] == "remote" && i + 2 < fields.size()) {
+            options.remotes.emplace_back(fields[i + 1], fields[i + 2]);
+            i += 2;
+        } else if (i + 1 >= fields.size()) {
+            return false;
+        } else if (fields[i] == "rules_path") {
+            options.rules_path.push_back(fields[++i]);
+        } else if (fields[i] == "rules_inline") {
+            options.rules_inline.push_back(fields[++i]);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+void logLoaded(int rulesLoaded, modsecurity::Rules& rules) {
+    if (rulesLoaded == -1) {
+        std::cerr << "Failed to load rules: " << rules.getParserError() << std::endl;
+    }
+}
+
+/**
+ * Loads the rules in the same order as HttpModSecurityFilterConfig
+ */
+std::unique_ptr<modsecurity::Rules> loadRules(const EngineOptions& options) {
+    std::unique_ptr<modsecurity::Rules> rules(new modsecurity::Rules());
+    for (const auto& path : options.rules_path) {
+        logLoaded(rules->loadFromUri(path.c_str()), *rules);
+    }
+    for (const auto& inline_rules : options.rules_inline) {
+        logLoaded(rules->load(inline_rules.c_str()), *rules);
+    }
+    if (options.remotes_overwrite_on_success) {
+        std::unique_ptr<modsecurity::Rules> remote_rules(new modsecurity::Rules());
+        for (const auto& remote : options.remotes) {
+            if (remote_rules->loadRemote(remote.first.c_str(), remote.second.c_str()) == -1) {
+                std::cerr << "Failed to load one remote rules: " << remote_rules->getParserError()
+                          << ". We fallback to local rules." << std::endl;
+                return rules;
+            }
+        }
+        return remote_rules;
+    }
+    for (const auto& remote : options.remotes) {
+        logLoaded(rules->loadRemote(remote.first.c_str(), remote.second.c_str()), *rules);
+    }
+    return rules;
+}
+
+} // namespace
+} // namespace Http
+} // namespace Envoy
+
+int main(int argc, char** argv) {
+    using namespace Envoy::Http;
+
+    EngineOptions options;
+    int rules_fd = -1;
+    if (!parseOptions(argc, argv, options, rules_fd)) {
+        std::cerr << "usage: " << argv[0] << " --rules_fd fd [--cpu n] "
+                  << "--channel memfd:request_fd:verdict_fd:space_fd..." << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (!readRulesConfig(rules_fd, options)) {
+        std::cerr << "Failed to read the rules configuration from fd " << rules_fd << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Don't outlive the supervisor
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    signal(SIGTERM, onTerminate);
+    signal(SIGINT, onTerminate);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (options.cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(options.cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+            std::cerr << "Failed to pin engine to cpu " << options.cpu << ": " << strerror(errno) << std::endl;
+        }
+    }
+
+    modsecurity::ModSecurity modsec;
+    modsec.setConnectorInformation("ModSecurity-test v0.0.1-alpha (ModSecurity inspection engine)");
+    modsec.setServerLogCb(logCb, modsecurity::RuleMessageLogProperty |
+                                 modsecurity::IncludeFullHighlightLogProperty);
+    std::unique_ptr<modsecurity::Rules> rules = loadRules(options);
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    std::vector<InspectionChannelPtr> channels;
+    for (const auto& descriptor : options.channels) {
+        InspectionChannelPtr channel = InspectionChannel::attach(descriptor);
+        if (channel == nullptr) {
+            std::cerr << "Failed to attach channel " << descriptor << ": " << strerror(errno) << std::endl;
+            return EXIT_FAILURE;
+        }
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.ptr = channel.get();
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, channel->requestFd(), &event);
+        channels.push_back(std::move(channel));
+    }
+
+    Engine engine(modsec, *rules);
+    // Requests may have been queued while no engine was running
+    for (auto& channel : channels) {
+        engine.process(*channel);
+    }
+    struct epoll_event events[64];
+    while (!terminate_) {
+        int ready = epoll_wait(epoll_fd, events, 64, -1);
+        for (int i = 0; i < ready; i++) {
+            InspectionChannel* channel = static_cast<InspectionChannel*>(events[i].data.ptr);
+            InspectionChannel::clear(channel->requestFd());
+            engine.process(*channel);
+        }
+    }
+    close(epoll_fd);
+    return EXIT_SUCCESS;
+}
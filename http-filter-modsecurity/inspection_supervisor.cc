@@ -0,0 +1,387 @@
+#include "inspection_supervisor.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <thread>
+
+#include "absl/strings/numbers.h"
+#include "common/common/fmt.h"
+#include "envoy/common/exception.h"
+
+namespace Envoy {
+namespace Http {
+
+namespace {
+
+constexpr uint32_t DefaultProcesses = 1;
+constexpr uint32_t DefaultRingBytes = 1024 * 1024;
+constexpr uint32_t DefaultTimeoutMs = 100;
+constexpr uint32_t DefaultStallTimeoutMs = 2000;
+// Engines exiting faster than this are restarted on a later supervisor tick
+constexpr std::chrono::seconds RestartBackoff(1);
+constexpr std::chrono::milliseconds SuperviseInterval(100);
+
+/**
+ * Closes the descriptors in [first, last], async-signal-safe
+ * @param open_max bound of the descriptors when close_range isn't available
+ */
+void closeDescriptors(int first, int last, int open_max) {
+    if (first > last) {
+        return;
+    }
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, first, last, 0) == 0) {
+        return;
+    }
+#endif
+    for (int fd = first; fd <= last && fd < open_max; fd++) {
+        close(fd);
+    }
+}
+
+struct ThreadLocalInspection : public ThreadLocal::ThreadLocalObject {
+  std::unique_ptr<InspectionClient> client;
+};
+
+} // namespace
+
+InspectionClient::InspectionClient(InspectionChannelSharedPtr channel, Event::Dispatcher& dispatcher)
+    : channel_(std::move(channel)), next_stream_id_(1), pending_flush_(false) {
+    file_event_ = dispatcher.createFileEvent(channel_->verdictFd(), [this](uint32_t) -> void { onVerdictsReady(); },
+                                             Event::FileTriggerType::Level, Event::FileReadyType::Read);
+}
+
+uint64_t InspectionClient::registerStream(Callbacks& callbacks) {
+    const uint64_t stream_id = next_stream_id_++;
+    streams_[stream_id] = &callbacks;
+    return stream_id;
+}
+
+void InspectionClient::unregisterStream(uint64_t stream_id) {
+    streams_.erase(stream_id);
+}
+
+bool InspectionClient::send(uint64_t stream_id, InspectionMessage type, const void* data, size_t length) {
+    // Left alone until the supervisor reset it, streams follow the fail policy meanwhile
+    if (channel_->failed()) {
+        return false;
+    }
+    const size_t max_payload = channel_->requests().maxPayload();
+    const uint8_t* begin = static_cast<const uint8_t*>(data);
+    do {
+        const size_t chunk = std::min(length, max_payload);
+        if (!channel_->requests().push(type, stream_id, begin, chunk)) {
+            return false;
+        }
+        pending_flush_ = true;
+        begin += chunk;
+        length -= chunk;
+    } while (length > 0);
+    return true;
+}
+
+bool InspectionClient::send(uint64_t stream_id, InspectionMessage type, const std::vector<std::string>& fields) {
+    const std::string message = encodeInspectionFields(fields);
+    return send(stream_id, type, message.data(), message.size());
+}
+
+bool InspectionClient::closeStream(uint64_t stream_id) {
+    pending_closes_.push_back(stream_id);
+    return sendPendingCloses();
+}
+
+bool InspectionClient::sendPendingCloses() {
+    if (channel_->failed()) {
+        // The next engine starts without transactions
+        pending_closes_.clear();
+        return false;
+    }
+    while (!pending_closes_.empty()) {
+        if (!channel_->requests().push(InspectionMessage::Close, pending_closes_.front(), nullptr, 0)) {
+            return false;
+        }
+        pending_flush_ = true;
+        pending_closes_.pop_front();
+    }
+    return true;
+}
+
+void InspectionClient::flush() {
+    sendPendingCloses();
+    if (pending_flush_) {
+        pending_flush_ = false;
+        InspectionChannel::signal(channel_->requestFd());
+    }
+}
+
+void InspectionClient::onVerdictsReady() {
+    InspectionChannel::clear(channel_->verdictFd());
+    const bool failed = channel_->failed();
+    channel_->drainVerdicts([this](InspectionMessage type, uint64_t stream_id, const uint8_t* data, size_t length) {
+        if (type != InspectionMessage::Verdict) {
+            return;
+        }
+        auto it = streams_.find(stream_id);
+        if (it == streams_.end()) {
+            // Stream was destroyed, or timed out, in the meantime
+            return;
+        }
+        auto fields = decodeInspectionFields(data, length);
+        uint32_t checkpoint;
+        int status;
+        if (fields.size() != 3 || !absl::SimpleAtoi(fields[0], &checkpoint) || !absl::SimpleAtoi(fields[1], &status)) {
+            ENVOY_LOG(error, "Malformed verdict from the inspection engine");
+            return;
+        }
+        it->second->onVerdict(static_cast<InspectionMessage>(checkpoint), status, fields[2] == "1");
+    });
+    if (!failed && channel_->failed()) {
+        ENVOY_LOG(error, "Corrupted verdict ring from the ModSecurity inspection engine, waiting for its restart");
+    }
+}
+
+InspectionSupervisor::InspectionSupervisor(const envoy::config::filter::http::modsec::v2::InspectionEngine& proto_config,
+                                           const envoy::config::filter::http::modsec::v2::Decoder& decoder,
+                                           Api::Api& api, ThreadLocal::SlotAllocator& tls, Stats::Scope& scope)
+    : timeout_(proto_config.timeout_ms() > 0 ? proto_config.timeout_ms() : DefaultTimeoutMs),
+      stall_timeout_(proto_config.stall_timeout_ms() > 0 ? proto_config.stall_timeout_ms() : DefaultStallTimeoutMs),
+      fail_closed_(proto_config.fail_closed()),
+      stats_{ALL_MODSEC_ENGINE_STATS(POOL_COUNTER_PREFIX(scope, "modsecurity."))},
+      time_source_(api.timeSource()), rules_fd_(-1), next_channel_(0), tls_(tls.allocateSlot()) {
+
+    // One channel per worker, plus the main thread which also gets a slot
+    const uint32_t channels = proto_config.channels() > 0 ? proto_config.channels()
+                                                          : std::thread::hardware_concurrency() + 1;
+    const uint32_t ring_bytes = proto_config.ring_bytes() > 0 ? proto_config.ring_bytes() : DefaultRingBytes;
+    for (uint32_t i = 0; i < channels; i++) {
+        InspectionChannelPtr channel = InspectionChannel::create(ring_bytes);
+        if (channel == nullptr) {
+            throw EnvoyException(fmt::format("Failed to create ModSecurity inspection channel: {}", strerror(errno)));
+        }
+        channels_.push_back(std::move(channel));
+    }
+    progress_.resize(channels);
+
+    // Engines load the same rules as the filter. Handed over in a memfd, the command line being readable by any
+    // local user (remote keys) and limited in size (inline rule sets)
+    std::vector<std::string> rules_config;
+    for (int i = 0; i < decoder.rules_path_size(); i++ ){
+        rules_config.insert(rules_config.end(), {"rules_path", decoder.rules_path(i)});
+    }
+    for (int i = 0; i < decoder.rules_inline_size(); i++ ){
+        rules_config.insert(rules_config.end(), {"rules_inline", decoder.rules_inline(i)});
+    }
+    for (int i = 0; i < decoder.remotes_size(); i++ ){
+        rules_config.insert(rules_config.end(), {"remote", decoder.remotes(i).key(), decoder.remotes(i).url()});
+    }
+    if (decoder.remotes_overwrite_on_success()) {
+        rules_config.push_back("remotes_overwrite_on_success");
+    }
+    rules_fd_ = createRulesFile(encodeInspectionFields(rules_config));
+
+    // Channels are spread round robin over the engines
+    const uint32_t processes = std::min<uint32_t>(proto_config.processes() > 0 ? proto_config.processes() : DefaultProcesses,
+                                                  channels);
+    engines_.resize(processes);
+    for (uint32_t i = 0; i < processes; i++) {
+        EngineProcess& engine = engines_[i];
+        engine.argv.push_back(proto_config.path());
+        engine.argv.insert(engine.argv.end(), {"--rules_fd", std::to_string(rules_fd_)});
+        engine.fds.push_back(rules_fd_);
+        if (proto_config.cpus_size() > 0) {
+            engine.argv.insert(engine.argv.end(), {"--cpu", std::to_string(proto_config.cpus(i % proto_config.cpus_size()))});
+        }
+        for (uint32_t c = i; c < channels; c += processes) {
+            engine.channels.push_back(c);
+            engine.argv.insert(engine.argv.end(), {"--channel", channels_[c]->descriptor()});
+            auto fds = channels_[c]->fds();
+            engine.fds.insert(engine.fds.end(), fds.begin(), fds.end());
+        }
+        spawn(engine);
+    }
+
+    tls_->set([this](Event::Dispatcher& dispatcher) -> ThreadLocal::ThreadLocalObjectSharedPtr {
+        auto inspection = std::make_shared<ThreadLocalInspection>();
+        const size_t index = next_channel_++;
+        if (index < channels_.size()) {
+            inspection->client = std::make_unique<InspectionClient>(channels_[index], dispatcher);
+        }
+        return inspection;
+    });
+
+    BackgroundTicker::Options options;
+    options.tick = [this]() -> void { supervise(); };
+    options.tick_interval = SuperviseInterval;
+    supervisor_ = std::make_unique<BackgroundTicker>(api, [](std::nullptr_t&) -> void {}, std::move(options));
+}
+
+InspectionSupervisor::~InspectionSupervisor() {
+    supervisor_->stop();
+    for (auto& engine : engines_) {
+        if (engine.pid > 0) {
+            kill(engine.pid, SIGTERM);
+            waitpid(engine.pid, nullptr, 0);
+        }
+    }
+    close(rules_fd_);
+}
+
+int InspectionSupervisor::createRulesFile(const std::string& rules_config) {
+    int fd = memfd_create("modsecurity-engine-rules", MFD_CLOEXEC);
+    if (fd == -1) {
+        throw EnvoyException(fmt::format("Failed to create ModSecurity inspection engine rules file: {}", strerror(errno)));
+    }
+    // Read by each engine with pread, the file offset is shared with them
+    size_t written = 0;
+    while (written < rules_config.size()) {
+        const ssize_t rc = write(fd, rules_config.data() + written, rules_config.size() - written);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rc < 0) {
+            const int error = errno;
+            close(fd);
+            throw EnvoyException(fmt::format("Failed to write ModSecurity inspection engine rules file: {}", strerror(error)));
+        }
+        written += rc;
+    }
+    return fd;
+}
+
+InspectionClient* InspectionSupervisor::client() {
+    InspectionClient* client = tls_->getTyped<ThreadLocalInspection>().client.get();
+    if (client == nullptr) {
+        stats_.engine_no_channel_.inc();
+    }
+    return client;
+}
+
+void InspectionSupervisor::spawn(EngineProcess& engine) {
+    // Everything the child needs is prepared before fork, the child only makes async-signal-safe calls
+    std::vector<char*> argv;
+    for (auto& arg : engine.argv) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    // Standard streams and the channels, envoy's listeners and connections are closed in the child
+    std::vector<int> inherited = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    inherited.insert(inherited.end(), engine.fds.begin(), engine.fds.end());
+    std::sort(inherited.begin(), inherited.end());
+    inherited.erase(std::unique(inherited.begin(), inherited.end()), inherited.end());
+    struct rlimit limit;
+    const int open_max = getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY
+                             ? static_cast<int>(std::min<rlim_t>(limit.rlim_cur, INT_MAX))
+                             : 65536;
+
+    engine.started = time_source_.monotonicTime();
+    engine.killed = false;
+    engine.pid = fork();
+    if (engine.pid == 0) {
+        // The channel descriptors are the only ones inherited by the engine
+        int next = 0;
+        for (int fd : inherited) {
+            closeDescriptors(next, fd - 1, open_max);
+            next = fd + 1;
+        }
+        closeDescriptors(next, INT_MAX, open_max);
+        for (int fd : engine.fds) {
+            fcntl(fd, F_SETFD, 0);
+        }
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    if (engine.pid == -1) {
+        ENVOY_LOG(error, "Failed to start ModSecurity inspection engine {}: {}", engine.argv[0], strerror(errno));
+    } else {
+        ENVOY_LOG(info, "Started ModSecurity inspection engine pid {}", engine.pid);
+    }
+}
+
+void InspectionSupervisor::supervise() {
+    const MonotonicTime now = time_source_.monotonicTime();
+    for (auto& engine : engines_) {
+        if (engine.pid > 0) {
+            int status;
+            if (waitpid(engine.pid, &status, WNOHANG) != engine.pid) {
+                // Reaped and restarted by a later tick
+                if (engine.killed) {
+                    continue;
+                }
+                if (failed(engine)) {
+                    ENVOY_LOG(error, "ModSecurity inspection engine pid {} corrupted its verdict ring, killing it", engine.pid);
+                    stats_.engine_channel_failures_.inc();
+                    engine.killed = true;
+                } else if (stalled(engine, now)) {
+                    ENVOY_LOG(error, "ModSecurity inspection engine pid {} stopped consuming requests, killing it", engine.pid);
+                    stats_.engine_stalls_.inc();
+                    engine.killed = true;
+                }
+                if (engine.killed) {
+                    kill(engine.pid, SIGKILL);
+                }
+                continue;
+            }
+            if (WIFSIGNALED(status)) {
+                ENVOY_LOG(error, "ModSecurity inspection engine pid {} killed by signal {}", engine.pid, WTERMSIG(status));
+            } else {
+                ENVOY_LOG(error, "ModSecurity inspection engine pid {} exited with status {}", engine.pid, WEXITSTATUS(status));
+            }
+            engine.pid = 0;
+        }
+        if (now - engine.started < RestartBackoff) {
+            continue;
+        }
+        // Streams in flight on the dead engine time out and follow the fail policy
+        for (size_t c : engine.channels) {
+            if (channels_[c]->failed()) {
+                // No process uses the rings anymore, the worker left them alone since it flagged them
+                channels_[c]->reset();
+                progress_[c] = ChannelProgress();
+            }
+        }
+        stats_.engine_restarts_.inc();
+        spawn(engine);
+    }
+}
+
+bool InspectionSupervisor::failed(const EngineProcess& engine) {
+    for (size_t c : engine.channels) {
+        if (channels_[c]->failed()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool InspectionSupervisor::stalled(const EngineProcess& engine, MonotonicTime now) {
+    bool stalled = false;
+    for (size_t c : engine.channels) {
+        SpscRing& requests = channels_[c]->requests();
+        ChannelProgress& progress = progress_[c];
+        // Records are consumed once processed, a transaction stuck in the engine keeps the tail still
+        const uint64_t tail = requests.tail();
+        if (tail != progress.tail || requests.head() == tail || now - engine.started < stall_timeout_) {
+            progress.tail = tail;
+            progress.since = now;
+            continue;
+        }
+        if (now - progress.since >= stall_timeout_) {
+            progress.since = now;
+            stalled = true;
+        }
+    }
+    return stalled;
+}
+
+} // namespace Http
+} // namespace Envoy
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "common/common/logger.h"
+#include "common/common/thread.h"
+#include "envoy/api/api.h"
+#include "envoy/common/time.h"
+#include "envoy/event/dispatcher.h"
+#include "envoy/event/file_event.h"
+#include "envoy/stats/scope.h"
+#include "envoy/stats/stats_macros.h"
+#include "envoy/thread_local/thread_local.h"
+
+#include "http-filter-modsecurity/http_filter.pb.h"
+
+#include "background_queue.h"
+#include "inspection_channel.h"
+
+namespace Envoy {
+namespace Http {
+
+/**
+ * All inspection engine stats. @see stats_macros.h
+ */
+#define ALL_MODSEC_ENGINE_STATS(COUNTER)                                                           \
+  COUNTER(engine_verdicts)                                                                         \
+  COUNTER(engine_timeouts)                                                                         \
+  COUNTER(engine_ring_full)                                                                        \
+  COUNTER(engine_restarts)                                                                         \
+  COUNTER(engine_stalls)                                                                           \
+  COUNTER(engine_channel_failures)                                                                 \
+  COUNTER(engine_no_channel)
+
+/**
+ * Struct definition for all inspection engine stats. @see stats_macros.h
+ */
+struct ModSecurityEngineStats {
+  ALL_MODSEC_ENGINE_STATS(GENERATE_COUNTER_STRUCT)
+};
+
+/**
+ * Worker side of a channel. Streams transactions to the inspection engine and dispatches
+ * the verdicts back to the filters, on the worker's event loop.
+ */
+class InspectionClient : public Logger::Loggable<Logger::Id::filter> {
+public:
+  class Callbacks {
+  public:
+    virtual ~Callbacks() = default;
+
+    /**
+     * Called for each verdict of the stream
+     * @param checkpoint the *Done message answered, or the message that made the transaction disruptive
+     */
+    virtual void onVerdict(InspectionMessage checkpoint, int status, bool disruptive) = 0;
+  };
+
+  InspectionClient(InspectionChannelSharedPtr channel, Event::Dispatcher& dispatcher);
+
+  uint64_t registerStream(Callbacks& callbacks);
+  void unregisterStream(uint64_t stream_id);
+
+  /**
+   * Queues a message. Large payloads are split into several records, only valid for body messages.
+   * @return false if the ring is full
+   */
+  bool send(uint64_t stream_id, InspectionMessage type, const void* data, size_t length);
+  bool send(uint64_t stream_id, InspectionMessage type, const std::vector<std::string>& fields);
+
+  /**
+   * Queues the Close of a stream, so the engine forgets its transaction. Retried by later flushes while
+   * the ring is full.
+   * @return false if the Close is left for a later flush
+   */
+  bool closeStream(uint64_t stream_id);
+
+  /**
+   * Wakes the engine for the messages queued since the last flush
+   */
+  void flush();
+
+private:
+  void onVerdictsReady();
+  /**
+   * @return false if the ring is full
+   */
+  bool sendPendingCloses();
+
+  // Shared with the supervisor, the client may be destroyed on its worker after the supervisor is gone
+  InspectionChannelSharedPtr channel_;
+  Event::FileEventPtr file_event_;
+  absl::flat_hash_map<uint64_t, Callbacks*> streams_;
+  // Streams destroyed while the ring was full, their Close is sent first by the next flush
+  std::deque<uint64_t> pending_closes_;
+  uint64_t next_stream_id_;
+  bool pending_flush_;
+};
+
+/**
+ * Owns the channels and the pool of inspection engine processes.
+ * Channels are handed out to workers through a thread local slot, one per worker.
+ * Engines are restarted by a supervisor thread when they exit, or killed first when they stop consuming.
+ */
+class InspectionSupervisor : public Logger::Loggable<Logger::Id::filter> {
+public:
+  InspectionSupervisor(const envoy::config::filter::http::modsec::v2::InspectionEngine& proto_config,
+                       const envoy::config::filter::http::modsec::v2::Decoder& decoder, Api::Api& api,
+                       ThreadLocal::SlotAllocator& tls, Stats::Scope& scope);
+  ~InspectionSupervisor();
+
+  /**
+   * @return the client of the calling worker, nullptr if no channel is left for it
+   */
+  InspectionClient* client();
+
+  std::chrono::milliseconds timeout() const { return timeout_; }
+  bool failClosed() const { return fail_closed_; }
+  ModSecurityEngineStats& stats() { return stats_; }
+
+private:
+  struct EngineProcess {
+    std::vector<std::string> argv;
+    std::vector<int> fds;
+    // Indexes in channels_
+    std::vector<size_t> channels;
+    pid_t pid = 0;
+    // Set once killed by the supervisor, until reaped
+    bool killed = false;
+    MonotonicTime started;
+  };
+
+  // Last consumer position seen on a request ring, only used by the supervisor thread
+  struct ChannelProgress {
+    uint64_t tail = 0;
+    MonotonicTime since;
+  };
+
+  /**
+   * @return a memfd holding the rules configuration of the engines, see inspection_engine.cc
+   */
+  static int createRulesFile(const std::string& rules_config);
+  void spawn(EngineProcess& engine);
+  void supervise();
+  /**
+   * @return true if one of the engine's channels was failed by its worker, see InspectionChannel::failed()
+   */
+  bool failed(const EngineProcess& engine);
+  /**
+   * @return true if one of the engine's request rings has had pending records without progress for stall_timeout_
+   */
+  bool stalled(const EngineProcess& engine, MonotonicTime now);
+
+  const std::chrono::milliseconds timeout_;
+  const std::chrono::milliseconds stall_timeout_;
+  const bool fail_closed_;
+  ModSecurityEngineStats stats_;
+  TimeSource& time_source_;
+
+  // Inherited by every engine
+  int rules_fd_;
+  std::vector<InspectionChannelSharedPtr> channels_;
+  std::vector<ChannelProgress> progress_;
+  std::atomic<size_t> next_channel_;
+  std::vector<EngineProcess> engines_;
+  ThreadLocal::SlotPtr tls_;
+  std::unique_ptr<BackgroundTicker> supervisor_;
+};
+
+typedef std::unique_ptr<InspectionSupervisor> InspectionSupervisorPtr;
+
+} // namespace Http
+} // namespace Envoy
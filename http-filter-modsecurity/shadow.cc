@@ -0,0 +1,171 @@
+#include "shadow.h"
+
+#include <time.h>
+
+#include "absl/strings/str_join.h"
+#include "modsecurity/audit_log.h"
+#include "modsecurity/rule_message.h"
+
+namespace Envoy {
+namespace Http {
+
+namespace {
+
+constexpr size_t DefaultMaxBodyBytes = 64 * 1024;
+constexpr size_t DefaultMaxPending = 1024;
+// Resolution of sample_rate
+constexpr uint64_t SampleRateScale = 1000000;
+
+uint64_t threadCpuTimeUs() {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+        return 0;
+    }
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+} // namespace
+
+ShadowEvaluator::ShadowEvaluator(const envoy::config::filter::http::modsec::v2::ShadowRules& proto_config,
+                                 AuditSink* audit, Api::Api& api, Stats::Scope& scope)
+    : sample_rate_(proto_config.sample_rate()),
+      max_body_bytes_(proto_config.max_body_bytes() > 0 ? proto_config.max_body_bytes() : DefaultMaxBodyBytes),
+      stats_{ALL_MODSEC_SHADOW_STATS(POOL_COUNTER_PREFIX(scope, "modsecurity."))},
+      own_audit_(audit == nullptr ? std::make_unique<AuditSink>(envoy::config::filter::http::modsec::v2::AuditLog(),
+                                                                api, scope)
+                                  : nullptr),
+      audit_(audit == nullptr ? *own_audit_ : *audit), random_(std::random_device()()) {
+
+    // A dedicated engine, so the shadow rules never share log callbacks or collections with the primary
+    modsec_.reset(new modsecurity::ModSecurity());
+    modsec_->setConnectorInformation("ModSecurity-test v0.0.1-alpha (ModSecurity shadow)");
+    modsec_->setServerLogCb(ShadowEvaluator::_logCb, modsecurity::RuleMessageLogProperty);
+
+    modsec_rules_.reset(new modsecurity::Rules());
+
+    for (int i = 0; i < proto_config.rules_path_size(); i++ ){
+        int rulesLoaded = modsec_rules_->loadFromUri(proto_config.rules_path(i).c_str());
+        ENVOY_LOG(debug, "Loading ModSecurity shadow config from {}", proto_config.rules_path(i));
+        if (rulesLoaded == -1) {
+            ENVOY_LOG(error, "Failed to load shadow rules: {}", modsec_rules_->getParserError());
+        } else {
+            ENVOY_LOG(info, "Loaded {} shadow rules", rulesLoaded);
+        };
+    }
+
+    for (int i = 0; i < proto_config.rules_inline_size(); i++ ){
+        int rulesLoaded = modsec_rules_->load(proto_config.rules_inline(i).c_str());
+        ENVOY_LOG(debug, "Loading ModSecurity shadow config from inline");
+        if (rulesLoaded == -1) {
+            ENVOY_LOG(error, "Failed to load shadow rules: {}", modsec_rules_->getParserError());
+        } else {
+            ENVOY_LOG(info, "Loaded {} shadow rules", rulesLoaded);
+        };
+    }
+
+    BackgroundQueue<ShadowRequestPtr>::Options options;
+    options.max_pending = proto_config.max_pending() > 0 ? proto_config.max_pending() : DefaultMaxPending;
+    options.idle_priority = true;
+    queue_ = std::make_unique<BackgroundQueue<ShadowRequestPtr>>(
+        api, [this](ShadowRequestPtr& request) -> void { evaluate(*request); }, std::move(options));
+}
+
+ShadowEvaluator::~ShadowEvaluator() {
+    queue_->stop();
+}
+
+bool ShadowEvaluator::sample(Runtime::RandomGenerator& random) {
+    if (sample_rate_ <= 0) {
+        return false;
+    }
+    if (sample_rate_ < 1 && random.random() % SampleRateScale >= sample_rate_ * SampleRateScale) {
+        return false;
+    }
+    stats_.shadow_sampled_.inc();
+    return true;
+}
+
+void ShadowEvaluator::submit(ShadowRequestPtr&& request) {
+    if (request->body_truncated) {
+        stats_.shadow_truncated_.inc();
+        return;
+    }
+    if (!queue_->push(std::move(request))) {
+        stats_.shadow_dropped_.inc();
+    }
+}
+
+void ShadowEvaluator::evaluate(const ShadowRequest& request) {
+    const uint64_t start = threadCpuTimeUs();
+
+    std::vector<std::string> matched;
+    modsecurity::Transaction transaction(modsec_.get(), modsec_rules_.get(), &matched);
+    transaction.processConnection(request.client_ip.c_str(), request.client_port,
+                                  request.server_ip.c_str(), request.server_port);
+    transaction.processURI(request.uri.c_str(), request.method.c_str(), request.protocol.c_str());
+    for (const auto& header : request.headers) {
+        transaction.addRequestHeader(header.first.c_str(), header.second.c_str());
+    }
+    transaction.processRequestHeaders();
+    if (!transaction.m_it.disruptive) {
+        transaction.appendRequestBody(reinterpret_cast<const unsigned char*>(request.body.data()),
+                                      request.body.size());
+        transaction.processRequestBody();
+    }
+
+    const bool shadow_disruptive = transaction.m_it.disruptive;
+    stats_.shadow_evaluated_.inc();
+    if (shadow_disruptive == request.primary_disruptive) {
+        stats_.shadow_agree_.inc();
+    } else {
+        if (shadow_disruptive) {
+            stats_.shadow_disagree_block_.inc();
+        } else {
+            stats_.shadow_disagree_allow_.inc();
+        }
+        ENVOY_LOG(warn, "ModSecurity shadow verdict disagreement on {}: primary {} ({}), shadow {} ({}), matched rules [{}]",
+                  transaction.m_id, request.primary_disruptive ? "blocked" : "allowed", request.primary_status,
+                  shadow_disruptive ? "blocked" : "allowed", transaction.m_it.status, absl::StrJoin(matched, ","));
+        writeAuditRecord(request, transaction);
+    }
+
+    stats_.shadow_cpu_us_.add(threadCpuTimeUs() - start);
+}
+
+void ShadowEvaluator::writeAuditRecord(const ShadowRequest& request, modsecurity::Transaction& transaction) {
+    using modsecurity::audit_log::AuditLog;
+    AuditLog& audit_log = *transaction.m_rules->m_auditLog;
+    const int parts = audit_log.getParts();
+    const bool json = audit_log.m_format == AuditLog::JSONAuditLogFormat;
+    // As the filter does, headers and body are written from the copy with the sink's limits and redaction
+    const int modsec_parts = parts & ~(AuditLog::BAuditLogPart | AuditLog::CAuditLogPart |
+                                       AuditLog::EAuditLogPart | AuditLog::FAuditLogPart);
+    if (json) {
+        boundary_.clear();
+    } else {
+        drawAuditLogBoundary(random_, boundary_);
+    }
+    AuditRecord record(audit_, json,
+                       json ? transaction.toJSON(modsec_parts)
+                            : transaction.toOldAuditLogFormat(modsec_parts, boundary_),
+                       boundary_);
+    if (parts & AuditLog::BAuditLogPart) {
+        record.addHeaders(true, request.headers);
+    }
+    if (parts & AuditLog::CAuditLogPart) {
+        record.addBody(true, request.body);
+    }
+    record.commit();
+}
+
+void ShadowEvaluator::_logCb(void *data, const void *ruleMessagev) {
+    auto matched = reinterpret_cast<std::vector<std::string>*>(data);
+    auto ruleMessage = reinterpret_cast<const modsecurity::RuleMessage *>(ruleMessagev);
+    if (matched == nullptr || ruleMessage == nullptr) {
+        return;
+    }
+    matched->push_back(std::to_string(ruleMessage->m_ruleId));
+}
+
+} // namespace Http
+} // namespace Envoy
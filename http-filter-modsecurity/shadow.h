@@ -0,0 +1,130 @@
+#pragma once
+
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common/common/logger.h"
+#include "envoy/api/api.h"
+#include "envoy/runtime/runtime.h"
+#include "envoy/stats/scope.h"
+#include "envoy/stats/stats_macros.h"
+
+#include "http-filter-modsecurity/http_filter.pb.h"
+
+#include "audit_sink.h"
+#include "background_queue.h"
+
+#include "modsecurity/modsecurity.h"
+#include "modsecurity/rules.h"
+#include "modsecurity/transaction.h"
+
+namespace Envoy {
+namespace Http {
+
+/**
+ * All shadow rules stats. @see stats_macros.h
+ */
+#define ALL_MODSEC_SHADOW_STATS(COUNTER)                                                           \
+  COUNTER(shadow_sampled)                                                                          \
+  COUNTER(shadow_dropped)                                                                          \
+  COUNTER(shadow_truncated)                                                                        \
+  COUNTER(shadow_evaluated)                                                                        \
+  COUNTER(shadow_agree)                                                                            \
+  COUNTER(shadow_disagree_block)                                                                   \
+  COUNTER(shadow_disagree_allow)                                                                   \
+  COUNTER(shadow_cpu_us)
+
+/**
+ * Struct definition for all shadow rules stats. @see stats_macros.h
+ */
+struct ModSecurityShadowStats {
+  ALL_MODSEC_SHADOW_STATS(GENERATE_COUNTER_STRUCT)
+};
+
+/**
+ * A copy of a sampled request, detached from the stream so it can outlive it.
+ */
+struct ShadowRequest {
+  std::string client_ip;
+  int client_port;
+  std::string server_ip;
+  int server_port;
+  std::string uri;
+  std::string method;
+  std::string protocol;
+  std::vector<std::pair<std::string, std::string>> headers;
+  std::string body;
+  // Set if the body exceeded max_body_bytes, the request is then not evaluated
+  bool body_truncated = false;
+  // Verdict of the primary rules for this request
+  bool primary_disruptive;
+  int primary_status;
+};
+
+typedef std::unique_ptr<ShadowRequest> ShadowRequestPtr;
+
+/**
+ * Evaluates sampled requests against a candidate rule set on a low priority background thread.
+ * Workers only copy the request and enqueue it, the shadow verdict never affects the response.
+ * Verdict disagreements are reported through stats and an audit log record of the shadow transaction.
+ * Requests whose body was truncated are not evaluated, the primary rules having seen the whole body.
+ */
+class ShadowEvaluator : public Logger::Loggable<Logger::Id::filter> {
+public:
+  /**
+   * @param audit the sink disagreements are written to, with its limits and redaction. If null, the
+   * evaluator owns one with the default limits.
+   */
+  ShadowEvaluator(const envoy::config::filter::http::modsec::v2::ShadowRules& proto_config, AuditSink* audit,
+                  Api::Api& api, Stats::Scope& scope);
+  ~ShadowEvaluator();
+
+  /**
+   * @return true if the current request should be copied to the shadow rules
+   */
+  bool sample(Runtime::RandomGenerator& random);
+
+  /**
+   * Enqueue a request for evaluation. Never blocks, drops the request if the queue is full.
+   */
+  void submit(ShadowRequestPtr&& request);
+
+  /**
+   * @return maximum number of request body bytes copied per sampled request
+   */
+  size_t maxBodyBytes() const { return max_body_bytes_; }
+
+  const ModSecurityShadowStats& stats() const { return stats_; }
+
+private:
+  /**
+   * This static function will be called by modsecurity for rules matched by the shadow rules
+   */
+  static void _logCb(void* data, const void* ruleMessagev);
+
+  void evaluate(const ShadowRequest& request);
+  void writeAuditRecord(const ShadowRequest& request, modsecurity::Transaction& transaction);
+
+  const double sample_rate_;
+  const size_t max_body_bytes_;
+  ModSecurityShadowStats stats_;
+
+  std::unique_ptr<modsecurity::ModSecurity> modsec_;
+  std::unique_ptr<modsecurity::Rules> modsec_rules_;
+  AuditSinkPtr own_audit_;
+  AuditSink& audit_;
+  // Used by the evaluation thread only
+  std::mt19937_64 random_;
+  std::string boundary_;
+
+  // Last, its thread uses the members above
+  std::unique_ptr<BackgroundQueue<ShadowRequestPtr>> queue_;
+};
+
+typedef std::unique_ptr<ShadowEvaluator> ShadowEvaluatorPtr;
+
+} // namespace Http
+} // namespace Envoy
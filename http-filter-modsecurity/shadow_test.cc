@@ -0,0 +1,183 @@
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "common/stats/isolated_store_impl.h"
+
+#include "shadow.h"
+
+#include "test/mocks/runtime/mocks.h"
+#include "test/test_common/environment.h"
+#include "test/test_common/utility.h"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+using testing::HasSubstr;
+using testing::Not;
+using testing::Return;
+
+namespace Envoy {
+namespace Http {
+namespace {
+
+// Candidate rules blocking an attack argument in phase 1 and an attack body in phase 2
+const char* Rules = R"(
+SecRuleEngine On
+SecRequestBodyAccess On
+SecAuditLogFormat JSON
+SecAuditLogParts ABCHZ
+SecRule ARGS:attack "@streq 1" "id:1,phase:1,deny,status:403,log"
+SecRule REQUEST_BODY "@contains attack" "id:2,phase:2,deny,status:403,log"
+)";
+
+class ShadowEvaluatorTest : public testing::Test {
+public:
+  ShadowEvaluatorTest() : api_(Api::createApiForTest()) {
+    proto_config_.add_rules_inline(Rules);
+    proto_config_.set_sample_rate(1);
+  }
+
+  void createEvaluator(AuditSink* audit = nullptr) {
+    evaluator_ = std::make_unique<ShadowEvaluator>(proto_config_, audit, *api_, store_);
+  }
+
+  ShadowRequestPtr request(const std::string& uri, const std::string& body, bool primary_disruptive) {
+    auto request = std::make_unique<ShadowRequest>();
+    request->client_ip = "10.0.0.1";
+    request->client_port = 34567;
+    request->server_ip = "10.0.0.2";
+    request->server_port = 80;
+    request->uri = uri;
+    request->method = "POST";
+    request->protocol = "HTTP/1.1";
+    request->headers = {{"host", "example.com"}, {"content-type", "text/plain"}};
+    request->body = body;
+    request->primary_disruptive = primary_disruptive;
+    request->primary_status = primary_disruptive ? 403 : 200;
+    return request;
+  }
+
+  // Evaluation runs on the evaluator's thread
+  void waitForEvaluated(uint64_t evaluated) {
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (evaluator_->stats().shadow_evaluated_.value() < evaluated &&
+           std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ASSERT_EQ(evaluated, evaluator_->stats().shadow_evaluated_.value());
+  }
+
+  Api::ApiPtr api_;
+  Stats::IsolatedStoreImpl store_;
+  envoy::config::filter::http::modsec::v2::ShadowRules proto_config_;
+  ShadowEvaluatorPtr evaluator_;
+};
+
+TEST_F(ShadowEvaluatorTest, SampleNone) {
+  proto_config_.set_sample_rate(0);
+  createEvaluator();
+  testing::NiceMock<Runtime::MockRandomGenerator> random;
+  EXPECT_FALSE(evaluator_->sample(random));
+  EXPECT_EQ(0, evaluator_->stats().shadow_sampled_.value());
+}
+
+TEST_F(ShadowEvaluatorTest, SampleAll) {
+  createEvaluator();
+  Runtime::MockRandomGenerator random;
+  EXPECT_CALL(random, random()).Times(0);
+  EXPECT_TRUE(evaluator_->sample(random));
+  EXPECT_EQ(1, evaluator_->stats().shadow_sampled_.value());
+}
+
+TEST_F(ShadowEvaluatorTest, SampleRate) {
+  proto_config_.set_sample_rate(0.25);
+  createEvaluator();
+  Runtime::MockRandomGenerator random;
+  EXPECT_CALL(random, random())
+      .WillOnce(Return(249999))
+      .WillOnce(Return(250000))
+      .WillOnce(Return(1000000 + 3))
+      .WillOnce(Return(999999));
+  EXPECT_TRUE(evaluator_->sample(random));
+  EXPECT_FALSE(evaluator_->sample(random));
+  EXPECT_TRUE(evaluator_->sample(random));
+  EXPECT_FALSE(evaluator_->sample(random));
+  EXPECT_EQ(2, evaluator_->stats().shadow_sampled_.value());
+}
+
+TEST_F(ShadowEvaluatorTest, Agree) {
+  createEvaluator();
+  evaluator_->submit(request("/comments", "hello", false));
+  evaluator_->submit(request("/comments?attack=1", "hello", true));
+  waitForEvaluated(2);
+  EXPECT_EQ(2, evaluator_->stats().shadow_agree_.value());
+  EXPECT_EQ(0, evaluator_->stats().shadow_disagree_block_.value());
+  EXPECT_EQ(0, evaluator_->stats().shadow_disagree_allow_.value());
+}
+
+TEST_F(ShadowEvaluatorTest, DisagreeBlock) {
+  createEvaluator();
+  evaluator_->submit(request("/comments?attack=1", "hello", false));
+  evaluator_->submit(request("/comments", "an attack", false));
+  waitForEvaluated(2);
+  EXPECT_EQ(0, evaluator_->stats().shadow_agree_.value());
+  EXPECT_EQ(2, evaluator_->stats().shadow_disagree_block_.value());
+}
+
+TEST_F(ShadowEvaluatorTest, DisagreeAllow) {
+  createEvaluator();
+  evaluator_->submit(request("/comments", "hello", true));
+  waitForEvaluated(1);
+  EXPECT_EQ(0, evaluator_->stats().shadow_agree_.value());
+  EXPECT_EQ(1, evaluator_->stats().shadow_disagree_allow_.value());
+}
+
+// The primary rules saw the whole body, a verdict on part of it would be a false disagreement
+TEST_F(ShadowEvaluatorTest, TruncatedBodyNotEvaluated) {
+  createEvaluator();
+  auto truncated = request("/comments", "", false);
+  truncated->body_truncated = true;
+  evaluator_->submit(std::move(truncated));
+  EXPECT_EQ(1, evaluator_->stats().shadow_truncated_.value());
+  evaluator_->submit(request("/comments", "hello", false));
+  waitForEvaluated(1);
+  EXPECT_EQ(1, evaluator_->stats().shadow_agree_.value());
+}
+
+// Disagreements are written through the audit sink, with its limits and redaction
+TEST_F(ShadowEvaluatorTest, DisagreementAuditRecord) {
+  const std::string path = TestEnvironment::temporaryPath("shadow_audit.log");
+  ::unlink(path.c_str());
+  envoy::config::filter::http::modsec::v2::AuditLog audit_config;
+  audit_config.set_path(path);
+  audit_config.add_redact_headers("authorization");
+  audit_config.add_redact_patterns("secret[0-9]+");
+  auto sink = std::make_unique<AuditSink>(audit_config, *api_, store_);
+  createEvaluator(sink.get());
+
+  auto disagreement = request("/comments", "an attack with secret123", false);
+  disagreement->headers.emplace_back("authorization", "Bearer token");
+  evaluator_->submit(std::move(disagreement));
+  waitForEvaluated(1);
+  EXPECT_EQ(1, evaluator_->stats().shadow_disagree_block_.value());
+  // Pending records are written on shutdown
+  evaluator_.reset();
+  sink.reset();
+
+  std::ifstream file(path);
+  std::stringstream record;
+  record << file.rdbuf();
+  EXPECT_THAT(record.str(), HasSubstr("\"transaction\":{"));
+  EXPECT_THAT(record.str(), HasSubstr("\"body\":\"an attack with [redacted]\""));
+  EXPECT_THAT(record.str(), HasSubstr("\"authorization\":\"[redacted]\""));
+  EXPECT_THAT(record.str(), Not(HasSubstr("secret123")));
+  EXPECT_THAT(record.str(), Not(HasSubstr("Bearer token")));
+}
+
+} // namespace
+} // namespace Http
+} // namespace Envoy
@@ -41,5 +41,25 @@ public:
 typedef ConstSingleton<MetadataModSecurityKeysValues>
     MetadataModSecurityKey;
 
+/**
+ * Keys of the transaction summary the filter writes to the dynamic metadata, under the ModSecurity namespace.
+ */
+class DynamicMetadataModSecurityKeysValues {
+public:
+  // Anomaly score set by the rules (tx.anomaly_score)
+  const std::string AnomalyScore = "anomaly_score";
+  // Ids of the matched rules
+  const std::string RuleIds = "rule_ids";
+  // Request and response body bytes inspected
+  const std::string InspectedBytes = "inspected_bytes";
+  // Time spent in ModSecurity phases, in microseconds
+  const std::string TimeUs = "time_us";
+  // Whether the transaction was intervened (disruptive)
+  const std::string Intervened = "intervened";
+};
+
+typedef ConstSingleton<DynamicMetadataModSecurityKeysValues>
+    DynamicMetadataModSecurityKey;
+
 } // namespace Http
 } // namespace Envoy
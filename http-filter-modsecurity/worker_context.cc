@@ -0,0 +1,31 @@
+#include "worker_context.h"
+
+#include <chrono>
+
+#include "audit_sink.h"
+
+namespace Envoy {
+namespace Http {
+
+WorkerContext::WorkerContext(std::shared_ptr<modsecurity::ModSecurity> modsec, uint64_t seed,
+                             TimeSource& time_source)
+    : modsec_(std::move(modsec)), random_(seed), time_source_(time_source) {
+}
+
+modsecurity::Transaction* WorkerContext::newTransaction(modsecurity::Rules& rules, void* log_cb_data) {
+    // Same as libmodsecurity: seconds since epoch followed by a random number in [0, 100)
+    const auto seconds = std::chrono::duration_cast<std::chrono::seconds>(
+        time_source_.systemTime().time_since_epoch()).count();
+    transaction_id_ = std::to_string(seconds);
+    transaction_id_.append(std::to_string(std::uniform_real_distribution<double>(0, 100)(random_)));
+    // The id is copied by the transaction
+    return new modsecurity::Transaction(modsec_.get(), &rules, const_cast<char*>(transaction_id_.c_str()), log_cb_data);
+}
+
+const std::string& WorkerContext::auditLogBoundary() {
+    drawAuditLogBoundary(random_, boundary_);
+    return boundary_;
+}
+
+} // namespace Http
+} // namespace Envoy
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+
+#include "envoy/common/time.h"
+#include "envoy/thread_local/thread_local.h"
+
+#include "modsecurity/modsecurity.h"
+#include "modsecurity/rules.h"
+#include "modsecurity/transaction.h"
+
+namespace Envoy {
+namespace Http {
+
+/**
+ * Per worker state of the filter, published through a thread local slot so that the per request paths
+ * never touch process wide state (rand() and its lock, a ModSecurity instance shared by all workers).
+ */
+class WorkerContext : public ThreadLocal::ThreadLocalObject {
+public:
+  /**
+   * @param modsec the ModSecurity instance transactions of this worker are created with, either the
+   * config's shared instance or one owned by this worker
+   * @param seed seed of the worker's random generator
+   */
+  WorkerContext(std::shared_ptr<modsecurity::ModSecurity> modsec, uint64_t seed, TimeSource& time_source);
+
+  modsecurity::ModSecurity& modsec() { return *modsec_; }
+
+  /**
+   * Creates a transaction with an id generated by this worker. The id has the same format as the one
+   * libmodsecurity generates, which reads std::random_device for every transaction.
+   */
+  modsecurity::Transaction* newTransaction(modsecurity::Rules& rules, void* log_cb_data);
+
+  /**
+   * @return a random audit log boundary ("-XXXXXXXX--"), valid until the next call on this worker
+   */
+  const std::string& auditLogBoundary();
+
+private:
+  const std::shared_ptr<modsecurity::ModSecurity> modsec_;
+  std::mt19937_64 random_;
+  TimeSource& time_source_;
+  // Reused across requests
+  std::string transaction_id_;
+  std::string boundary_;
+};
+
+} // namespace Http
+} // namespace Envoy